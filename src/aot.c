@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aot.h"
+#include "gbz80.h"
+
+/* give up on ROMs decoding into absurd amounts of code */
+#define AOT_MAX_BLOCKS 0x10000
+
+/* block start waiting to be explored */
+typedef struct {
+    uint16_t addr;
+    uint8_t rom_bank;
+} aot_work;
+
+static struct {
+    const uint8_t *rom;
+    size_t size;
+    unsigned banks;
+    bool mbc;        /* the game can switch banks */
+    uint8_t *seen;   /* bit per bank mapped at 0x4000 and address explored */
+    uint8_t *listed; /* bit per address of blocks in bank 0 */
+
+    aot_work *stack;
+    size_t depth, max_depth;
+
+    aot_block *blocks;
+    size_t count, max;
+} aot;
+
+static bool test_bit(const uint8_t *bits, size_t i)
+{
+    return bits[i / 8] & 1 << (i % 8);
+}
+
+static bool test_and_set(uint8_t *bits, size_t i)
+{
+    bool set = bits[i / 8] & 1 << (i % 8);
+    bits[i / 8] |= 1 << (i % 8);
+    return set;
+}
+
+/* byte at addr while rom_bank is mapped at 0x4000 */
+static uint8_t rom_byte(uint8_t rom_bank, uint16_t addr)
+{
+    size_t offset = addr < 0x4000 ? addr : rom_bank * 0x4000 + addr - 0x4000;
+    /* an invalid opcode, decoding beyond the ROM ends there */
+    return offset < aot.size ? aot.rom[offset] : 0xd3;
+}
+
+/* Queue addr unless it was explored already. It is only marked once it is
+ * explored: explore() drops what it queued when it runs into data, and real
+ * code may still lead to the same address.
+ */
+static void push(uint8_t rom_bank, uint16_t addr)
+{
+    /* RAM code is translated when it runs */
+    if (addr >= 0x8000 || test_bit(aot.seen, rom_bank * 0x8000 + addr))
+        return;
+
+    if (aot.depth == aot.max_depth) {
+        size_t max = aot.max_depth ? 2 * aot.max_depth : 256;
+        aot_work *stack = realloc(aot.stack, max * sizeof(aot_work));
+        if (!stack)
+            return;
+        aot.stack = stack;
+        aot.max_depth = max;
+    }
+    aot.stack[aot.depth++] = (aot_work){.addr = addr, .rom_bank = rom_bank};
+}
+
+static void add_block(uint8_t rom_bank, uint16_t addr)
+{
+    uint8_t bank = addr < 0x4000 ? 0 : rom_bank;
+    if (bank == 0 && test_and_set(aot.listed, addr))
+        return;
+
+    if (aot.count == aot.max) {
+        size_t max = aot.max ? 2 * aot.max : 256;
+        aot_block *blocks = realloc(aot.blocks, max * sizeof(aot_block));
+        if (!blocks)
+            return;
+        aot.blocks = blocks;
+        aot.max = max;
+    }
+    aot.blocks[aot.count++] =
+        (aot_block){.bank = bank, .rom_bank = rom_bank, .addr = addr};
+}
+
+/* Decode the block at work like compile() does and queue its successors */
+static void explore(aot_work work)
+{
+    size_t mark = aot.depth;
+    uint8_t rom_bank = work.rom_bank;
+    bool const_a = false;
+
+    /* queued more than once before it was explored */
+    if (test_and_set(aot.seen, work.rom_bank * 0x8000 + work.addr))
+        return;
+
+    for (uint16_t pc = work.addr; pc < 0x8000;) {
+        uint8_t code[3] = {rom_byte(rom_bank, pc), rom_byte(rom_bank, pc + 1),
+                           rom_byte(rom_bank, pc + 2)};
+        const gbz80_inst *inst = gbz80_decode(code);
+        if (inst->opcode == ERROR) {
+            /* most likely data, forget what was found on the way */
+            aot.depth = mark;
+            return;
+        }
+        uint16_t next = pc + inst->bytes;
+
+        switch (inst->opcode) {
+        case JR:
+            push(rom_bank, next + (int8_t) code[1]);
+            break;
+        case JP:
+        case CALL:
+            if (inst->op2 == IMM16)
+                push(rom_bank, code[2] << 8 | code[1]);
+            break;
+        case RST:
+            push(rom_bank, (inst->op2 - MEM_0x00) * 0x08);
+            break;
+        default:
+            break;
+        }
+
+        /* returns land behind calls, execution resumes behind EI and HALT */
+        if (inst->opcode == CALL || inst->opcode == RST ||
+            inst->opcode == EI || inst->opcode == HALT)
+            push(rom_bank, next);
+
+        /* follow the usual ld a, n; ld (0x2000 - 0x3fff), a bank switch */
+        if (inst->opcode == LD && inst->op1 == MEM_16 &&
+            inst->op2 == REG_A && const_a && aot.mbc && pc < 0x4000) {
+            uint16_t reg = code[2] << 8 | code[1];
+            unsigned bank = rom_byte(rom_bank, pc - 1);
+            if (bank == 0)
+                bank = 1;
+            if (reg >= 0x2000 && reg < 0x4000 && bank < aot.banks)
+                rom_bank = bank;
+        }
+        const_a = inst->opcode == LD && inst->op1 == REG_A &&
+                  inst->op2 == IMM8;
+
+        if (inst->flags & INST_FLAG_ENDS_BLOCK)
+            break;
+        pc = next;
+    }
+
+    add_block(work.rom_bank, work.addr);
+}
+
+size_t aot_discover(gb_memory *mem, aot_block **blocks)
+{
+    struct stat st;
+    if (mem->fd < 0 || fstat(mem->fd, &st) != 0 || st.st_size < 0x8000)
+        return 0;
+
+    memset(&aot, 0, sizeof(aot));
+    aot.size = st.st_size;
+    aot.banks = aot.size / 0x4000 < 256 ? aot.size / 0x4000 : 256;
+    aot.mbc = mem->mbc != MBC_NONE;
+    aot.rom = mmap(NULL, aot.size, PROT_READ, MAP_PRIVATE, mem->fd, 0);
+    aot.seen = calloc(aot.banks, 0x8000 / 8);
+    aot.listed = calloc(1, 0x4000 / 8);
+    if (aot.rom == MAP_FAILED || !aot.seen || !aot.listed) {
+        LOG_ERROR("could not scan ROM for code (%i)\n", errno);
+        goto out;
+    }
+
+    /* RST and interrupt vectors and the entry point, bank 1 is mapped at
+     * reset
+     */
+    for (uint16_t addr = 0x00; addr <= 0x60; addr += 0x08)
+        push(1, addr);
+    push(1, 0x100);
+
+    while (aot.depth > 0 && aot.count < AOT_MAX_BLOCKS)
+        explore(aot.stack[--aot.depth]);
+
+out:
+    if (aot.rom != MAP_FAILED)
+        munmap((void *) aot.rom, aot.size);
+    free(aot.seen);
+    free(aot.listed);
+    free(aot.stack);
+
+    *blocks = aot.blocks;
+    return aot.count;
+}
@@ -0,0 +1,22 @@
+#ifndef JITBOY_AOT_H
+#define JITBOY_AOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memory.h"
+
+/* ROM block found ahead of time */
+typedef struct {
+    uint8_t bank;     /* 0 for blocks in 0x0000 - 0x3fff */
+    uint8_t rom_bank; /* bank assumed to be mapped at 0x4000 */
+    uint16_t addr;
+} aot_block;
+
+/* Find the blocks reachable from the RST and interrupt vectors and the entry
+ * point of the ROM in mem by recursive descent. Returns the number of blocks
+ * stored in the array *blocks, which the caller frees.
+ */
+size_t aot_discover(gb_memory *mem, aot_block **blocks);
+
+#endif
@@ -0,0 +1,206 @@
+#include <SDL.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "codecache.h"
+
+/* blocks start at cache line boundaries */
+#define CODE_ALIGN 64
+
+/* hole left behind by released code */
+typedef struct code_chunk {
+    size_t offset, size;
+    struct code_chunk *next;
+} code_chunk;
+
+static struct {
+    uint8_t *rw, *rx; /* views of the same memory */
+    size_t size;
+    size_t top;            /* bump allocation continues here */
+    size_t used;           /* bytes held by translated blocks */
+    code_chunk *free_list; /* address ordered, neighbours are merged */
+    SDL_mutex *lock;       /* compile workers allocate concurrently */
+} cache;
+
+bool code_cache_init(size_t size)
+{
+    int fd = memfd_create("jitboy-code", 0);
+    if (fd < 0) {
+        LOG_ERROR("could not create code cache (%i)\n", errno);
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        LOG_ERROR("could not create code cache (%i)\n", errno);
+        close(fd);
+        return false;
+    }
+
+    cache.rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    cache.rx = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    /* the mappings keep the memory alive */
+    close(fd);
+
+    if (cache.rw == MAP_FAILED || cache.rx == MAP_FAILED) {
+        LOG_ERROR("could not map code cache (%i)\n", errno);
+        if (cache.rw != MAP_FAILED)
+            munmap(cache.rw, size);
+        if (cache.rx != MAP_FAILED)
+            munmap(cache.rx, size);
+        cache.rw = cache.rx = NULL;
+        return false;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* hot code shares few iTLB entries if the kernel backs shmem by huge
+     * pages, failure is harmless
+     */
+    madvise(cache.rx, size, MADV_HUGEPAGE);
+    madvise(cache.rw, size, MADV_HUGEPAGE);
+#endif
+
+    cache.size = size;
+    cache.top = 0;
+    cache.used = 0;
+    cache.free_list = NULL;
+    cache.lock = SDL_CreateMutex();
+    return cache.lock != NULL;
+}
+
+void code_cache_free(void)
+{
+    while (cache.free_list) {
+        code_chunk *next = cache.free_list->next;
+        free(cache.free_list);
+        cache.free_list = next;
+    }
+
+    if (cache.rx) {
+        munmap(cache.rw, cache.size);
+        munmap(cache.rx, cache.size);
+    }
+    cache.rw = cache.rx = NULL;
+    if (cache.lock)
+        SDL_DestroyMutex(cache.lock);
+    cache.lock = NULL;
+}
+
+static void *code_cache_take(size_t size)
+{
+    size = (size + CODE_ALIGN - 1) & ~(size_t)(CODE_ALIGN - 1);
+
+    /* first fit in the holes of released blocks */
+    for (code_chunk **p = &cache.free_list; *p; p = &(*p)->next) {
+        code_chunk *chunk = *p;
+        if (chunk->size < size)
+            continue;
+
+        size_t offset = chunk->offset;
+        chunk->offset += size;
+        chunk->size -= size;
+        if (chunk->size == 0) {
+            *p = chunk->next;
+            free(chunk);
+        }
+        cache.used += size;
+        return cache.rx + offset;
+    }
+
+    if (cache.size - cache.top < size) {
+        LOG_ERROR("code cache is full\n");
+        return NULL;
+    }
+
+    size_t offset = cache.top;
+    cache.top += size;
+    cache.used += size;
+    return cache.rx + offset;
+}
+
+static void code_cache_put(void *code, size_t size)
+{
+    size = (size + CODE_ALIGN - 1) & ~(size_t)(CODE_ALIGN - 1);
+    size_t offset = (uint8_t *) code - cache.rx;
+    cache.used -= size;
+
+    code_chunk *prev = NULL, *next = cache.free_list;
+    while (next && next->offset < offset) {
+        prev = next;
+        next = next->next;
+    }
+
+    if (prev && prev->offset + prev->size == offset) {
+        prev->size += size;
+    } else {
+        code_chunk *chunk = malloc(sizeof(code_chunk));
+        if (!chunk) /* the hole is lost, the cache stays consistent */
+            return;
+        *chunk = (code_chunk){.offset = offset, .size = size, .next = next};
+        if (prev)
+            prev->next = chunk;
+        else
+            cache.free_list = chunk;
+        prev = chunk;
+    }
+
+    if (next && prev->offset + prev->size == next->offset) {
+        prev->size += next->size;
+        prev->next = next->next;
+        free(next);
+    }
+
+    /* a hole at the end goes back to the bump allocator */
+    if (!prev->next && prev->offset + prev->size == cache.top) {
+        cache.top = prev->offset;
+        code_chunk **p = &cache.free_list;
+        while (*p != prev)
+            p = &(*p)->next;
+        *p = NULL;
+        free(prev);
+    }
+}
+
+void *code_cache_alloc(size_t size)
+{
+    SDL_LockMutex(cache.lock);
+    void *code = code_cache_take(size);
+    SDL_UnlockMutex(cache.lock);
+    return code;
+}
+
+void code_cache_release(void *code, size_t size)
+{
+    if (!code)
+        return;
+
+    SDL_LockMutex(cache.lock);
+    code_cache_put(code, size);
+    SDL_UnlockMutex(cache.lock);
+}
+
+void *code_cache_rw(void *code)
+{
+    return cache.rw + ((uint8_t *) code - cache.rx);
+}
+
+void code_cache_statistics(void)
+{
+    size_t holes = 0, largest = 0;
+    unsigned count = 0;
+    for (code_chunk *chunk = cache.free_list; chunk; chunk = chunk->next) {
+        holes += chunk->size;
+        if (chunk->size > largest)
+            largest = chunk->size;
+        ++count;
+    }
+
+    printf("- code cache: %zu KiB used, %zu KiB allocated of %zu KiB (%.1f%%)\n",
+           cache.used >> 10, cache.top >> 10, cache.size >> 10,
+           cache.size ? 100.0 * cache.top / cache.size : 0.0);
+    printf("- code cache fragmentation: %u holes, %zu KiB free, largest %zu "
+           "bytes (%.1f%%)\n",
+           count, holes >> 10, largest,
+           cache.top ? 100.0 * holes / cache.top : 0.0);
+}
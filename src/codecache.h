@@ -0,0 +1,31 @@
+#ifndef JITBOY_CODECACHE_H
+#define JITBOY_CODECACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* address space reserved for translated code */
+#define CODE_CACHE_SIZE (64 << 20)
+
+/* Reserve the code cache. It is mapped twice, writable for the code generator
+ * and executable for the translated blocks, so code is never writable and
+ * executable at the same address.
+ */
+bool code_cache_init(size_t size);
+
+/* Release the code cache with all translated code */
+void code_cache_free(void);
+
+/* allocate size bytes of code, returns the executable address */
+void *code_cache_alloc(size_t size);
+
+/* return memory allocated by code_cache_alloc(), code may be NULL */
+void code_cache_release(void *code, size_t size);
+
+/* writable alias of the executable address code */
+void *code_cache_rw(void *code);
+
+/* print fill level and fragmentation */
+void code_cache_statistics(void);
+
+#endif
@@ -14,4 +14,9 @@
 
 #endif
 
+#if defined(FASTMEM) && defined(INSTRUCTION_TEST)
+/* gbit has to observe every store, which only the helper call reports */
+#undef FASTMEM
+#endif
+
 #endif
@@ -1,13 +1,27 @@
 #include <inttypes.h>
+#include <string.h>
 #include <sys/mman.h>
 
+#include "aot.h"
+#include "codecache.h"
 #include "core.h"
+#include "diskcache.h"
+#include "interp.h"
 #include "interrupt.h"
+#include "jitqueue.h"
 #include "save.h"
 
 void free_block(gb_block *block)
 {
-    munmap(block->mem, block->size);
+    unlink_block(block);
+#ifdef FASTMEM
+    fastmem_release(block);
+#endif
+    code_cache_release(block->mem, block->size);
+    block->mem = NULL;
+    free(block->exits);
+    block->exits = NULL;
+    block->exit_count = 0;
 }
 
 bool init_vm(gb_vm *vm,
@@ -20,6 +34,14 @@ bool init_vm(gb_vm *vm,
     if (!gb_memory_init(&vm->memory, filename))
         return false;
 
+    if (!code_cache_init(CODE_CACHE_SIZE) || !emit_init())
+        return false;
+
+#ifdef FASTMEM
+    if (!fastmem_init())
+        return false;
+#endif
+
     dump_header_info(&vm->memory);
 
     vm->state.mem = &vm->memory;
@@ -47,6 +69,12 @@ bool init_vm(gb_vm *vm,
 
     vm->state.trap_reason = 0;
 
+    for (int i = 0; i < GB_RAS_SIZE; ++i)
+        vm->state.ras[i].addr = GB_RAS_NONE;
+    vm->state.ras_top = 0;
+    for (int i = 0; i < GB_JC_SIZE; ++i)
+        vm->state.jump_cache[i].key = GB_JC_NONE;
+
     vm->memory.mem[0xff05] = 0x00;
     vm->memory.mem[0xff06] = 0x00;
     vm->memory.mem[0xff07] = 0x00;
@@ -79,16 +107,18 @@ bool init_vm(gb_vm *vm,
     vm->memory.mem[0xff4b] = 0x00;
     vm->memory.mem[0xffff] = 0x00;
 
-    for (int block = 0; block < MAX_ROM_BANKS; ++block)
-        for (int i = 0; i < 0x4000; ++i) {
-            vm->compiled_blocks[block][i].exec_count = 0;
-            vm->compiled_blocks[block][i].func = 0;
-        }
+    vm->state.last_exit = NULL;
+    vm->jit_threshold = DEFAULT_JIT_THRESHOLD;
 
-    for (int i = 0; i < 0x80; ++i) {
-        vm->highmem_blocks[i].exec_count = 0;
-        vm->highmem_blocks[i].func = 0;
-    }
+    for (int bank = 0; bank < MAX_ROM_BANKS; ++bank)
+        vm->compiled_blocks[bank] = NULL;
+    vm->block_pages = NULL;
+
+    for (int i = 0; i < 0x8000 / BLOCK_PAGE_SIZE; ++i)
+        vm->ram_pages[i] = NULL;
+    vm->ram_blocks = NULL;
+    vm->stale_blocks = NULL;
+    memset(vm->state.code_map, 0, sizeof(vm->state.code_map));
 
     if (!read_battery(vm->memory.savname, &vm->memory))
         LOG_ERROR("Fail to read battery\n");
@@ -113,59 +143,316 @@ bool init_vm(gb_vm *vm,
     return true;
 }
 
+/* entry for the block starting at addr in ROM bank, allocating its page */
+static gb_block **block_slot(gb_vm *vm, uint8_t bank, uint16_t addr)
+{
+    gb_block_page **dir = vm->compiled_blocks[bank];
+    if (!dir) {
+        dir = calloc(BLOCK_PAGES, sizeof(gb_block_page *));
+        if (!dir)
+            return NULL;
+        vm->compiled_blocks[bank] = dir;
+    }
+
+    gb_block_page **page = &dir[(addr & 0x3fff) / BLOCK_PAGE_SIZE];
+    if (!*page) {
+        *page = calloc(1, sizeof(gb_block_page));
+        if (!*page)
+            return NULL;
+        (*page)->bank = bank;
+        (*page)->base = addr & ~(BLOCK_PAGE_SIZE - 1);
+        (*page)->next = vm->block_pages;
+        vm->block_pages = *page;
+    }
+
+    return &(*page)->blocks[addr % BLOCK_PAGE_SIZE];
+}
+
+/* Entry for the ROM block starting at addr in bank. Unless the translation
+ * cache has it, the block starts out interpreted.
+ */
+static gb_block *new_rom_block(gb_vm *vm, uint8_t bank, uint16_t addr)
+{
+    gb_block **slot = block_slot(vm, bank, addr);
+    if (!slot) {
+        LOG_ERROR("could not allocate block table\n");
+        return NULL;
+    }
+
+    gb_block *block = calloc(1, sizeof(gb_block));
+    if (!block) {
+        LOG_ERROR("could not allocate block\n");
+        return NULL;
+    }
+    if (!disk_cache_load(block, bank, addr))
+        block->start_address = addr;
+
+    *slot = block;
+    return block;
+}
+
+/* Install translation into the ROM block at addr in bank. This happens on the
+ * emulation thread, which is the only one using the block tables.
+ */
+static void install_rom_block(gb_block *block,
+                              const gb_block *translation,
+                              uint8_t bank,
+                              uint16_t addr)
+{
+    unsigned exec_count = block->exec_count;
+    *block = *translation;
+    block->exec_count = exec_count;
+    for (unsigned i = 0; i < block->exit_count; ++i)
+        block->exits[i].from = block;
+
+#ifdef FASTMEM
+    if (block->sites && !fastmem_register(block)) {
+        free_block(block);
+        block->func = NULL;
+        block->untranslatable = true;
+        return;
+    }
+#endif
+    disk_cache_record(block, bank, addr);
+}
+
+/* translate the hot ROM block starting at addr in bank */
+static void compile_rom_block(gb_vm *vm,
+                              gb_block *block,
+                              uint8_t bank,
+                              uint16_t addr)
+{
+    gb_block translation = {0};
+    if (!compile(&translation, &vm->memory, addr, vm->opt_level)) {
+        LOG_ERROR("could not translate block @%#x, interpreting it\n", addr);
+        block->untranslatable = true;
+        return;
+    }
+    install_rom_block(block, &translation, bank, addr);
+}
+
+/* install the blocks translated by the compile workers in the meantime */
+static void publish_rom_blocks(void)
+{
+    jit_job *job = jit_queue_finished();
+    while (job) {
+        jit_job *next = job->next;
+        job->block->queued = false;
+        if (job->ok) {
+            install_rom_block(job->block, &job->result, job->bank, job->addr);
+        } else {
+            LOG_ERROR("could not translate block @%#x, interpreting it\n",
+                      job->addr);
+            job->block->untranslatable = true;
+        }
+        free(job);
+        job = next;
+    }
+}
+
+bool translate_rom_ahead(gb_vm *vm)
+{
+    unsigned start = SDL_GetTicks();
+    aot_block *found;
+    size_t count = aot_discover(&vm->memory, &found);
+    unsigned requested = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < count; ++i) {
+        aot_block *b = &found[i];
+        gb_block *block = find_block(vm, b->bank, b->addr);
+        if (!block)
+            block = new_rom_block(vm, b->bank, b->addr);
+        if (!block) {
+            ok = false;
+            break;
+        }
+        if (block->func || block->queued)
+            continue;
+        if (!jit_queue_request(block, b->bank, b->rom_bank, b->addr)) {
+            LOG_ERROR("ahead of time translation needs compile workers\n");
+            ok = false;
+            break;
+        }
+        requested++;
+    }
+    free(found);
+
+    jit_queue_wait();
+    publish_rom_blocks();
+    printf("Translated %u of %zu blocks found in the ROM in %u ms\n",
+           requested, count, SDL_GetTicks() - start);
+    return ok;
+}
+
+static gb_block *find_ram_block(gb_vm *vm, uint16_t addr)
+{
+    gb_block_page *page = vm->ram_pages[(addr - 0x8000) / BLOCK_PAGE_SIZE];
+    return page ? page->blocks[addr % BLOCK_PAGE_SIZE] : NULL;
+}
+
+/* Mark the code of block in the code map. Under FASTMEM the mirror pages
+ * holding the code also become read-only, so stores to them reach
+ * gb_memory_write().
+ */
+static void map_ram_block(gb_vm *vm, gb_block *block)
+{
+    unsigned start = block->start_address;
+    unsigned end = block->end_address < start ? 0xffff : block->end_address;
+    memset(&vm->state.code_map[start - 0x8000], 1, end - start + 1);
+
+#ifdef FASTMEM
+    /* the page with IO registers and HRAM is always read-only */
+    for (unsigned page = start & ~0xfff; page <= end && page < 0xf000;
+         page += 0x1000)
+        gb_memory_protect_page(&vm->memory, page, PROT_READ);
+#endif
+}
+
+/* translate the RAM block starting at addr */
+static gb_block *compile_ram_block(gb_vm *vm, uint16_t addr)
+{
+    gb_block_page **page = &vm->ram_pages[(addr - 0x8000) / BLOCK_PAGE_SIZE];
+    if (!*page) {
+        *page = calloc(1, sizeof(gb_block_page));
+        if (!*page) {
+            LOG_ERROR("could not allocate block table\n");
+            return NULL;
+        }
+        (*page)->base = addr & ~(BLOCK_PAGE_SIZE - 1);
+    }
+
+    gb_block *block = calloc(1, sizeof(gb_block));
+    if (!block) {
+        LOG_ERROR("could not allocate block\n");
+        return NULL;
+    }
+    if (!compile(block, &vm->memory, addr, vm->opt_level)) {
+        free(block);
+        return NULL;
+    }
+#ifdef FASTMEM
+    if (block->sites && !fastmem_register(block)) {
+        free_block(block);
+        free(block);
+        return NULL;
+    }
+#endif
+
+    (*page)->blocks[addr % BLOCK_PAGE_SIZE] = block;
+    block->next = vm->ram_blocks;
+    vm->ram_blocks = block;
+    map_ram_block(vm, block);
+    return block;
+}
+
+void invalidate_ram_blocks(gb_vm *vm, uint16_t start, uint16_t end)
+{
+    bool changed = false;
+
+    for (gb_block **p = &vm->ram_blocks; *p;) {
+        gb_block *block = *p;
+        unsigned block_end =
+            block->end_address < block->start_address ? 0xffff
+                                                      : block->end_address;
+        if (block_end < start || block->start_address > end) {
+            p = &block->next;
+            continue;
+        }
+
+        LOG_DEBUG("invalidate block @%#x\n", block->start_address);
+        uint16_t addr = block->start_address;
+        vm->ram_pages[(addr - 0x8000) / BLOCK_PAGE_SIZE]
+            ->blocks[addr % BLOCK_PAGE_SIZE] = NULL;
+
+        /* the block may be the one storing, release it later */
+        *p = block->next;
+        block->next = vm->stale_blocks;
+        vm->stale_blocks = block;
+        changed = true;
+    }
+
+    if (!changed)
+        return;
+
+    /* blocks may overlap, rebuild the code map from the remaining ones */
+    memset(vm->state.code_map, 0, sizeof(vm->state.code_map));
+#ifdef FASTMEM
+    for (unsigned page = 0x8000; page < 0xf000; page += 0x1000)
+        gb_memory_protect_page(&vm->memory, page, PROT_READ | PROT_WRITE);
+#endif
+    for (gb_block *block = vm->ram_blocks; block; block = block->next)
+        map_ram_block(vm, block);
+}
+
+static void free_stale_blocks(gb_vm *vm)
+{
+    while (vm->stale_blocks) {
+        gb_block *block = vm->stale_blocks;
+        vm->stale_blocks = block->next;
+        free_block(block);
+        free(block);
+    }
+}
+
 bool run_vm(gb_vm *vm, bool turbo)
 {
     uint16_t prev_pc = vm->state.last_pc;
     vm->state.last_pc = vm->state.pc;
 
+    publish_rom_blocks();
+
+    /* exit of the previous block that led to this one, if it can be linked */
+    gb_link *exit = vm->state.last_exit;
+    vm->state.last_exit = NULL;
+
     /* compile next block / get cached block */
-    if (vm->state.pc < 0x4000) { /* first block */
-        if (vm->compiled_blocks[0][vm->state.pc].exec_count == 0) {
-            if (!compile(&vm->compiled_blocks[0][vm->state.pc], &vm->memory,
-                         vm->state.pc, vm->opt_level))
+    if (vm->state.pc < 0x8000) { /* execute function in ROM */
+        uint8_t bank = vm->state.pc < 0x4000 ? 0 : vm->memory.current_rom_bank;
+        gb_block *block = find_block(vm, bank, vm->state.pc);
+        if (!block) {
+            block = new_rom_block(vm, bank, vm->state.pc);
+            if (!block)
                 goto compile_error;
         }
+        if (!block->func && !block->untranslatable && !block->queued &&
+            block->exec_count >= vm->jit_threshold &&
+            !jit_queue_request(block, bank, vm->memory.current_rom_bank,
+                               vm->state.pc))
+            compile_rom_block(vm, block, bank, vm->state.pc);
         LOG_DEBUG("execute function @%#x (count %i)\n", vm->state.pc,
-                  vm->compiled_blocks[0][vm->state.pc].exec_count);
-        vm->compiled_blocks[0][vm->state.pc].exec_count++;
-        vm->state.pc = vm->compiled_blocks[0][vm->state.pc].func(&vm->state);
-        LOG_DEBUG("finished\n");
-    } else if (vm->state.pc < 0x8000) { /* execute function in ROM */
-        uint8_t bank = vm->memory.current_rom_bank;
-        if (vm->compiled_blocks[bank][vm->state.pc - 0x4000].exec_count == 0) {
-            if (!compile(&vm->compiled_blocks[bank][vm->state.pc - 0x4000],
-                         &vm->memory, vm->state.pc, vm->opt_level))
-                goto compile_error;
-        }
-        LOG_DEBUG("execute function @%#x (count %i)\n", vm->state.pc,
-                  vm->compiled_blocks[bank][vm->state.pc - 0x4000].exec_count);
-        vm->compiled_blocks[bank][vm->state.pc - 0x4000].exec_count++;
-        vm->state.pc =
-            vm->compiled_blocks[bank][vm->state.pc - 0x4000].func(&vm->state);
-        LOG_DEBUG("finished\n");
-    } else if (vm->state.pc >=
-               0xff80) { /* execute function in internal RAM, e.g. for DMA */
-        if (vm->highmem_blocks[vm->state.pc - 0xff80].exec_count == 0) {
-            if (!compile(&vm->highmem_blocks[vm->state.pc - 0xff80],
-                         &vm->memory, vm->state.pc, vm->opt_level))
-                goto compile_error;
+                  block->exec_count);
+        block->exec_count++;
+        if (block->func) {
+            if (exit)
+                link_block(exit, block, bank);
+            /* ROM blocks stay until the VM is freed */
+            uint32_t key = gb_jump_key(vm->state.pc, bank);
+            vm->state.jump_cache[key % GB_JC_SIZE].key = key;
+            vm->state.jump_cache[key % GB_JC_SIZE].code = block->func;
+            vm->state.pc = run_block(&vm->state, block);
+        } else if (!interpret(&vm->state)) {
+            goto compile_error;
         }
-        LOG_DEBUG("execute function @%#x (count %i)\n", vm->state.pc,
-                  vm->highmem_blocks[vm->state.pc - 0xff80].exec_count);
-        vm->highmem_blocks[vm->state.pc - 0xff80].exec_count++;
-        vm->state.pc =
-            vm->highmem_blocks[vm->state.pc - 0xff80].func(&vm->state);
         LOG_DEBUG("finished\n");
-    } else { /* execute function in RAM */
-        gb_block temp = {0};
-        if (!compile(&temp, &vm->memory, vm->state.pc, vm->opt_level))
+    } else { /* execute function in RAM, e.g. the DMA routine in HRAM */
+        gb_block *block = find_ram_block(vm, vm->state.pc);
+        if (!block)
+            block = compile_ram_block(vm, vm->state.pc);
+        if (block) {
+            LOG_DEBUG("execute function in ram @%#x (count %i)\n",
+                      vm->state.pc, block->exec_count);
+            block->exec_count++;
+            vm->state.pc = run_block(&vm->state, block);
+        } else if (!interpret(&vm->state)) { /* could not translate it */
             goto compile_error;
-        LOG_DEBUG("execute function in ram\n");
-        vm->state.pc = temp.func(&vm->state);
+        }
         LOG_DEBUG("finished\n");
-        free_block(&temp);
     }
 
+    /* code overwritten by the block that just returned */
+    free_stale_blocks(vm);
+
     LOG_DEBUG("ioregs: STAT=%02x LY=%02x IF=%02x IE=%02x\n",
               vm->memory.mem[0xff41], vm->memory.mem[0xff44],
               vm->memory.mem[0xff0f], vm->memory.mem[0xffff]);
@@ -224,8 +511,10 @@ bool run_vm(gb_vm *vm, bool turbo)
 
                 /* save PC to stack */
                 vm->state._sp -= 2;
-                *(uint16_t *) (&vm->state.mem->mem[vm->state._sp]) =
-                    vm->state.pc;
+                gb_memory_write(&vm->state, vm->state._sp, vm->state.pc);
+                gb_memory_write(&vm->state, vm->state._sp + 1,
+                                vm->state.pc >> 8);
+                gb_ras_push(&vm->state);
                 // jump to interrupt address
                 vm->state.pc = interrupt_addr;
             }
@@ -274,46 +563,76 @@ static void show_statistics(gb_vm *vm)
     printf("\nStatistics:\n");
 
     uint64_t compiled_functions = 0;
+    uint64_t interpreted_functions = 0;
     uint64_t most_executed = 0;
     uint64_t most_executed_addr = 0;
     uint64_t total_executed = 0;
 
-    for (int block = 0; block < MAX_ROM_BANKS; ++block)
-        for (int i = 0; i < 0x4000; ++i) {
-            if (vm->compiled_blocks[block][i].exec_count > 0) {
+    for (gb_block_page *page = vm->block_pages; page; page = page->next)
+        for (int i = 0; i < BLOCK_PAGE_SIZE; ++i) {
+            gb_block *block = page->blocks[i];
+            if (!block)
+                continue;
+            if (block->func)
                 ++compiled_functions;
-                if (vm->compiled_blocks[block][i].exec_count > most_executed) {
-                    most_executed_addr = block * 0x4000 + i;
-                    most_executed = vm->compiled_blocks[block][i].exec_count;
-                }
-                total_executed += vm->compiled_blocks[block][i].exec_count;
+            else
+                ++interpreted_functions;
+            if (block->exec_count > most_executed) {
+                most_executed_addr =
+                    page->bank * 0x4000 + ((page->base + i) & 0x3fff);
+                most_executed = block->exec_count;
             }
+            total_executed += block->exec_count;
         }
 
     printf("- total compiled rom functions: %" PRIu64 "\n", compiled_functions);
+    printf("- interpreted rom blocks: %" PRIu64 "\n", interpreted_functions);
     printf("- most frequent executed block @%" PRIx64 ", %" PRIu64
            " times executed\n",
            most_executed_addr, most_executed);
-    int cnt = vm->compiled_blocks[0][0x40].exec_count
-                  ? vm->compiled_blocks[0][0x40].exec_count
-                  : 1;
+    /* every frame enters the VBlank interrupt handler */
+    gb_block *vblank = find_block(vm, 0, 0x40);
+    unsigned frames = vblank ? vblank->exec_count : 0;
     printf("- executed blocks total / per frame: %" PRIu64 " / %" PRIu64 "\n",
-           total_executed, total_executed / cnt);
-    printf("- frames: %u\n", vm->compiled_blocks[0][0x40].exec_count);
+           total_executed, total_executed / (frames ? frames : 1));
+    printf("- frames: %u\n", frames);
+    compile_statistics();
+    jit_queue_statistics();
+    code_cache_statistics();
 }
 
 bool free_vm(gb_vm *vm)
 {
     show_statistics(vm);
+    jit_queue_close();
+    disk_cache_close();
+
+    while (vm->block_pages) {
+        gb_block_page *page = vm->block_pages;
+        for (int i = 0; i < BLOCK_PAGE_SIZE; ++i) {
+            if (page->blocks[i]) {
+                free_block(page->blocks[i]);
+                free(page->blocks[i]);
+            }
+        }
+        vm->block_pages = page->next;
+        free(page);
+    }
 
-    for (int block = 0; block < MAX_ROM_BANKS; ++block)
-        for (int i = 0; i < 0x4000; ++i)
-            if (vm->compiled_blocks[block][i].exec_count > 0)
-                free_block(&vm->compiled_blocks[block][i]);
+    for (int bank = 0; bank < MAX_ROM_BANKS; ++bank) {
+        free(vm->compiled_blocks[bank]);
+        vm->compiled_blocks[bank] = NULL;
+    }
+
+    invalidate_ram_blocks(vm, 0x8000, 0xffff);
+    free_stale_blocks(vm);
+    for (int i = 0; i < 0x8000 / BLOCK_PAGE_SIZE; ++i) {
+        free(vm->ram_pages[i]);
+        vm->ram_pages[i] = NULL;
+    }
 
-    for (int i = 0; i < 0x80; ++i)
-        if (vm->highmem_blocks[i].exec_count > 0)
-            free_block(&vm->highmem_blocks[i]);
+    compile_free();
+    code_cache_free();
 
     /* destroy window */
     deinit_window(&vm->lcd);
@@ -12,11 +12,31 @@
 #define MAX_ROM_BANKS 256
 #define MAX_RAM_BANKS 16
 
+#define DEFAULT_JIT_THRESHOLD 2
+
+/* Translated ROM blocks are found through a per-bank directory of pages with
+ * one entry per start address. Directories, pages and blocks are allocated
+ * when the first block inside them is translated.
+ */
+#define BLOCK_PAGE_SIZE 0x100
+#define BLOCK_PAGES (0x4000 / BLOCK_PAGE_SIZE)
+
+typedef struct gb_block_page {
+    gb_block *blocks[BLOCK_PAGE_SIZE];
+    struct gb_block_page *next; /* all pages, for statistics and teardown */
+    uint8_t bank;
+    uint16_t base;
+} gb_block_page;
+
 typedef struct {
     gb_state state;
     gb_memory memory;
-    gb_block compiled_blocks[MAX_ROM_BANKS][0x4000];  // bank, start address
-    gb_block highmem_blocks[0x80];
+    gb_block_page **compiled_blocks[MAX_ROM_BANKS];  // bank, page directory
+    gb_block_page *block_pages;
+    // blocks translated from RAM 0x8000 - 0xffff, by start address
+    gb_block_page *ram_pages[0x8000 / BLOCK_PAGE_SIZE];
+    gb_block *ram_blocks;   /* live RAM blocks */
+    gb_block *stale_blocks; /* overwritten RAM blocks, freed by run_vm */
     gb_lcd lcd;
     gb_audio audio;
     bool draw_frame;
@@ -27,16 +47,37 @@ typedef struct {
     unsigned last_time;
 
     int opt_level;
+    /* executions of a ROM block in the interpreter before it is translated */
+    unsigned jit_threshold;
 } gb_vm;
 
 void free_block(gb_block *block);
 
+/* Drop the translated RAM blocks overlapping start - end, as the code there is
+ * about to change. They are released once control is back in run_vm().
+ */
+void invalidate_ram_blocks(gb_vm *vm, uint16_t start, uint16_t end);
+
+/* translated block starting at addr in ROM bank, NULL if there is none */
+static inline gb_block *find_block(gb_vm *vm, uint8_t bank, uint16_t addr)
+{
+    gb_block_page **dir = vm->compiled_blocks[bank];
+    if (!dir)
+        return NULL;
+    gb_block_page *page = dir[(addr & 0x3fff) / BLOCK_PAGE_SIZE];
+    return page ? page->blocks[addr % BLOCK_PAGE_SIZE] : NULL;
+}
+
 bool init_vm(gb_vm *vm,
              const char *filename,
              int opt_level,
              int scale,
              bool init_render,
              bool init_sound);
+/* Translate the ROM blocks found by static control flow discovery on the
+ * compile workers, before the game starts.
+ */
+bool translate_rom_ahead(gb_vm *vm);
 bool run_vm(gb_vm *vm, bool turbo);
 bool free_vm(gb_vm *vm);
 
@@ -0,0 +1,526 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "codecache.h"
+#include "diskcache.h"
+
+#define DISK_CACHE_MAGIC "JITBOY03"
+
+/* A cache file holds the ROM blocks translated for one ROM image, binary and
+ * optimization level: the header, the entries sorted by key and the data of
+ * each entry. The data is the code as emitted, followed by its exits and
+ * store sites. Offsets in there are relative to the start of the code.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t build; /* hash of the binary, the code embeds helper addresses */
+    uint64_t rom;   /* hash of the ROM image */
+    uint32_t opt_level;
+    uint32_t count;
+} cache_header;
+
+typedef struct {
+    uint32_t key;    /* bank << 16 | start address */
+    uint32_t offset; /* of the data, from the start of the file */
+    uint32_t size;   /* of the code */
+    uint32_t func;
+    uint16_t end_address;
+    uint16_t exit_count;
+    uint16_t site_count;
+    uint16_t reserved;
+} cache_entry;
+
+typedef struct {
+    uint16_t target;
+    uint16_t indirect;
+    uint32_t jmp;
+    uint32_t bank; /* 0 for targets in bank 0 */
+    uint32_t key;  /* 0 for static exits */
+    uint32_t ptr;  /* imm64 loading the gb_link of the exit, 0 for none */
+} cache_exit;
+
+typedef struct {
+    uint32_t store, stub;
+} cache_site;
+
+/* block translated during this run */
+typedef struct cache_record {
+    cache_entry entry;
+    uint8_t *data;
+    struct cache_record *next;
+} cache_record;
+
+static struct {
+    char *path; /* NULL if the cache is disabled */
+    uint64_t build, rom;
+    int opt_level;
+
+    /* cache file written by a previous run or another instance */
+    uint8_t *file;
+    size_t file_size;
+    const cache_entry *entries;
+    uint32_t count;
+
+    cache_record *records;
+    uint32_t record_count;
+    unsigned loaded;
+} dc;
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool hash_file(const char *filename, uint64_t *hash)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    *hash = HASH_INIT;
+    if (ok && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = data != MAP_FAILED;
+        if (ok) {
+            *hash = hash_bytes(HASH_INIT, data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+static size_t entry_data_size(const cache_entry *entry)
+{
+    return entry->size + entry->exit_count * sizeof(cache_exit) +
+           entry->site_count * sizeof(cache_site);
+}
+
+/* whether offset and the width bytes patched there lie inside the code */
+static bool code_range(const cache_entry *entry, uint32_t offset, size_t width)
+{
+    return (size_t) offset + width <= entry->size;
+}
+
+/* whether every offset in the data of entry stays inside its code, data has
+ * to be inside the file
+ */
+static bool entry_valid(const cache_entry *entry)
+{
+    const uint8_t *data = dc.file + entry->offset + entry->size;
+    if (!code_range(entry, entry->func, 1))
+        return false;
+
+    for (unsigned i = 0; i < entry->exit_count; ++i) {
+        cache_exit exit;
+        memcpy(&exit, data, sizeof(exit));
+        data += sizeof(exit);
+        if (!code_range(entry, exit.jmp, 4) ||
+            (exit.bank && !code_range(entry, exit.bank, 1)) ||
+            (exit.key && !code_range(entry, exit.key, 4)) ||
+            (exit.ptr && !code_range(entry, exit.ptr, sizeof(uint64_t))))
+            return false;
+    }
+    for (unsigned i = 0; i < entry->site_count; ++i) {
+        cache_site site;
+        memcpy(&site, data, sizeof(site));
+        data += sizeof(site);
+        if (!code_range(entry, site.store, 1) ||
+            !code_range(entry, site.stub, 1))
+            return false;
+    }
+    return true;
+}
+
+static void disk_cache_unmap(void)
+{
+    if (dc.file)
+        munmap(dc.file, dc.file_size);
+    dc.file = NULL;
+    dc.file_size = 0;
+    dc.entries = NULL;
+    dc.count = 0;
+}
+
+/* map the current cache file, it is shared between processes */
+static void disk_cache_map(void)
+{
+    int fd = open(dc.path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(cache_header)) {
+        void *file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (file != MAP_FAILED) {
+            dc.file = file;
+            dc.file_size = st.st_size;
+        }
+    }
+    close(fd);
+    if (!dc.file)
+        return;
+
+    const cache_header *header = (const cache_header *) dc.file;
+    if (memcmp(header->magic, DISK_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->build != dc.build || header->rom != dc.rom ||
+        header->opt_level != (uint32_t) dc.opt_level ||
+        sizeof(cache_header) + (size_t) header->count * sizeof(cache_entry) >
+            dc.file_size) {
+        LOG_DEBUG("ignoring stale translation cache %s\n", dc.path);
+        disk_cache_unmap();
+        return;
+    }
+
+    /* both disk_cache_load() and disk_cache_write() trust the entries */
+    const cache_entry *entries = (const cache_entry *) (header + 1);
+    for (uint32_t i = 0; i < header->count; ++i) {
+        if ((size_t) entries[i].offset + entry_data_size(&entries[i]) >
+                dc.file_size ||
+            (i > 0 && entries[i - 1].key >= entries[i].key) ||
+            !entry_valid(&entries[i])) {
+            LOG_ERROR("ignoring corrupt translation cache %s\n", dc.path);
+            disk_cache_unmap();
+            return;
+        }
+    }
+
+    dc.entries = entries;
+    dc.count = header->count;
+}
+
+bool disk_cache_init(gb_memory *mem, const char *dir, int opt_level)
+{
+    if (!dir)
+        return true;
+
+    if (!hash_file("/proc/self/exe", &dc.build) ||
+        !hash_file(mem->filename, &dc.rom)) {
+        LOG_ERROR("could not identify translation cache (%i)\n", errno);
+        return false;
+    }
+
+    size_t len = strlen(dir) + 32;
+    dc.path = malloc(len);
+    if (!dc.path)
+        return false;
+    snprintf(dc.path, len, "%s/%016" PRIx64 "-O%i.jit", dir, dc.rom,
+             opt_level);
+    dc.opt_level = opt_level;
+
+    disk_cache_map();
+    return true;
+}
+
+static int compare_key(const void *key, const void *entry)
+{
+    uint32_t a = *(const uint32_t *) key;
+    uint32_t b = ((const cache_entry *) entry)->key;
+    return a < b ? -1 : a > b;
+}
+
+bool disk_cache_load(gb_block *block, uint8_t bank, uint16_t addr)
+{
+    if (!dc.entries)
+        return false;
+
+    uint32_t key = (uint32_t) bank << 16 | addr;
+    const cache_entry *entry =
+        bsearch(&key, dc.entries, dc.count, sizeof(cache_entry), compare_key);
+    if (!entry)
+        return false;
+#ifndef FASTMEM
+    if (entry->site_count > 0)
+        return false;
+#endif
+
+    const uint8_t *data = dc.file + entry->offset;
+    uint8_t *code = code_cache_alloc(entry->size);
+    if (!code)
+        return false;
+    memcpy(code_cache_rw(code), data, entry->size);
+    data += entry->size;
+
+    gb_link *exits = NULL;
+    if (entry->exit_count > 0) {
+        exits = calloc(entry->exit_count, sizeof(gb_link));
+        if (!exits) {
+            code_cache_release(code, entry->size);
+            return false;
+        }
+    }
+    for (unsigned i = 0; i < entry->exit_count; ++i) {
+        cache_exit exit;
+        memcpy(&exit, data, sizeof(exit));
+        data += sizeof(exit);
+
+        exits[i] = (gb_link){.target = exit.target,
+                             .indirect = exit.indirect,
+                             .jmp = code + exit.jmp,
+                             .bank = exit.bank ? code + exit.bank : NULL,
+                             .key = exit.key ? code + exit.key : NULL,
+                             .from = block};
+        /* relocate the exit to its new gb_link */
+        uint64_t link = (uintptr_t) &exits[i];
+        if (exit.ptr)
+            memcpy(code_cache_rw(code + exit.ptr), &link, sizeof(link));
+    }
+
+    *block = (gb_block){.func = code + entry->func,
+                        .start_address = addr,
+                        .end_address = entry->end_address,
+                        .size = entry->size,
+                        .mem = code,
+                        .exits = exits,
+                        .exit_count = entry->exit_count};
+
+#ifdef FASTMEM
+    if (entry->site_count > 0) {
+        block->sites = malloc(entry->site_count * sizeof(gb_fastmem_site));
+        if (!block->sites) {
+            free(exits);
+            code_cache_release(code, entry->size);
+            memset(block, 0, sizeof(*block));
+            return false;
+        }
+        for (unsigned i = 0; i < entry->site_count; ++i) {
+            cache_site site;
+            memcpy(&site, data, sizeof(site));
+            data += sizeof(site);
+            block->sites[i].store = code + site.store;
+            block->sites[i].stub = code + site.stub;
+        }
+        block->site_count = entry->site_count;
+        if (!fastmem_register(block)) {
+            free(block->sites);
+            free(exits);
+            code_cache_release(code, entry->size);
+            memset(block, 0, sizeof(*block));
+            return false;
+        }
+    }
+#endif
+
+    dc.loaded++;
+    return true;
+}
+
+void disk_cache_record(const gb_block *block, uint8_t bank, uint16_t addr)
+{
+    if (!dc.path)
+        return;
+
+    const uint8_t *code = block->mem;
+    cache_entry entry = {
+        .key = (uint32_t) bank << 16 | addr,
+        .size = block->size,
+        .func = (const uint8_t *) block->func - code,
+        .end_address = block->end_address,
+        .exit_count = block->exit_count,
+#ifdef FASTMEM
+        .site_count = block->site_count,
+#endif
+    };
+
+    cache_record *record = malloc(sizeof(cache_record));
+    uint8_t *data = malloc(entry_data_size(&entry));
+    if (!record || !data)
+        goto fail;
+
+    memcpy(data, code, block->size);
+    uint8_t *p = data + block->size;
+
+    for (unsigned i = 0; i < block->exit_count; ++i) {
+        const gb_link *link = &block->exits[i];
+        /* inst_exit() loads the link right behind the patchable jump with
+         * mov64 tmp1 (49 ba imm64), inst_exit_indirect() with tmp2 and only
+         * for the last entry of an inline cache
+         */
+        const uint8_t *ptr = link->jmp + 4 + 2;
+        uint64_t imm;
+        memcpy(&imm, ptr, sizeof(imm));
+        if (imm != (uintptr_t) link) {
+            if (!link->indirect)
+                goto fail;
+            ptr = NULL;
+        }
+
+        cache_exit exit = {.target = link->target,
+                           .indirect = link->indirect,
+                           .jmp = link->jmp - code,
+                           .bank = link->bank ? link->bank - code : 0,
+                           .key = link->key ? link->key - code : 0,
+                           .ptr = ptr ? ptr - code : 0};
+        memcpy(p, &exit, sizeof(exit));
+        p += sizeof(exit);
+    }
+
+#ifdef FASTMEM
+    for (unsigned i = 0; i < block->site_count; ++i) {
+        cache_site site = {.store = block->sites[i].store - code,
+                           .stub = block->sites[i].stub - code};
+        memcpy(p, &site, sizeof(site));
+        p += sizeof(site);
+    }
+#endif
+
+    record->entry = entry;
+    record->data = data;
+    record->next = dc.records;
+    dc.records = record;
+    dc.record_count++;
+    return;
+
+fail:
+    LOG_DEBUG("block @%#x is not cached\n", addr);
+    free(record);
+    free(data);
+}
+
+typedef struct {
+    cache_entry entry;
+    const uint8_t *data;
+} cache_item;
+
+static int compare_items(const void *a, const void *b)
+{
+    return compare_key(&((const cache_item *) a)->entry.key,
+                       &((const cache_item *) b)->entry);
+}
+
+/* Lock the cache file against other instances writing it. rename() replaces
+ * the file, so the lock only holds if the path still names the locked file.
+ * Returns the locked descriptor, -1 on failure.
+ */
+static int disk_cache_lock(void)
+{
+    for (;;) {
+        int fd = open(dc.path, O_RDONLY | O_CREAT, 0644);
+        if (fd < 0)
+            return -1;
+
+        struct stat locked, current;
+        if (flock(fd, LOCK_EX) != 0 || fstat(fd, &locked) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (stat(dc.path, &current) == 0 && current.st_dev == locked.st_dev &&
+            current.st_ino == locked.st_ino)
+            return fd;
+        close(fd);
+    }
+}
+
+/* Merge the current cache file with the new blocks into a new file, which
+ * atomically replaces it. Instances writing at the same time are serialized
+ * by the lock, so none of them drops the blocks of another. Processes still
+ * mapping the old file keep using it.
+ */
+static void disk_cache_write(void)
+{
+    int lock = disk_cache_lock();
+    if (lock < 0) {
+        LOG_ERROR("could not lock translation cache %s (%i)\n", dc.path,
+                  errno);
+        return;
+    }
+    disk_cache_unmap();
+    disk_cache_map();
+
+    uint32_t total = dc.count + dc.record_count;
+    cache_item *items = malloc(total * sizeof(cache_item));
+    if (!items) {
+        close(lock);
+        return;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < dc.count; ++i)
+        items[n++] = (cache_item){dc.entries[i], dc.file + dc.entries[i].offset};
+    for (cache_record *r = dc.records; r; r = r->next)
+        items[n++] = (cache_item){r->entry, r->data};
+    qsort(items, n, sizeof(cache_item), compare_items);
+
+    /* drop duplicates, another instance may have translated the same block */
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; ++i)
+        if (count == 0 || items[count - 1].entry.key != items[i].entry.key)
+            items[count++] = items[i];
+
+    size_t offset = sizeof(cache_header) + count * sizeof(cache_entry);
+    for (uint32_t i = 0; i < count; ++i) {
+        items[i].entry.offset = offset;
+        offset += entry_data_size(&items[i].entry);
+    }
+
+    size_t len = strlen(dc.path) + 32;
+    char *tmp = malloc(len);
+    FILE *f = tmp ? (snprintf(tmp, len, "%s.%d.tmp", dc.path, (int) getpid()),
+                     fopen(tmp, "wb"))
+                  : NULL;
+    if (!f) {
+        LOG_ERROR("could not write translation cache %s\n", dc.path);
+        free(tmp);
+        free(items);
+        close(lock);
+        return;
+    }
+
+    cache_header header = {.build = dc.build,
+                           .rom = dc.rom,
+                           .opt_level = dc.opt_level,
+                           .count = count};
+    memcpy(header.magic, DISK_CACHE_MAGIC, sizeof(header.magic));
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (uint32_t i = 0; ok && i < count; ++i)
+        ok = fwrite(&items[i].entry, sizeof(cache_entry), 1, f) == 1;
+    for (uint32_t i = 0; ok && i < count; ++i)
+        ok = fwrite(items[i].data, entry_data_size(&items[i].entry), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmp, dc.path) != 0) {
+        LOG_ERROR("could not write translation cache %s\n", dc.path);
+        unlink(tmp);
+    }
+    free(tmp);
+    free(items);
+    close(lock);
+}
+
+void disk_cache_close(void)
+{
+    if (!dc.path)
+        return;
+
+    printf("- translation cache: %u blocks loaded, %u blocks added\n",
+           dc.loaded, dc.record_count);
+    if (dc.record_count > 0)
+        disk_cache_write();
+
+    while (dc.records) {
+        cache_record *next = dc.records->next;
+        free(dc.records->data);
+        free(dc.records);
+        dc.records = next;
+    }
+    disk_cache_unmap();
+    free(dc.path);
+    memset(&dc, 0, sizeof(dc));
+}
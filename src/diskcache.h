@@ -0,0 +1,27 @@
+#ifndef JITBOY_DISKCACHE_H
+#define JITBOY_DISKCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "emit.h"
+#include "memory.h"
+
+/* Open the translation cache of the ROM in mem inside directory dir. Blocks
+ * translated with opt_level by a previous run of the same binary are loaded
+ * from there instead of being translated again.
+ */
+bool disk_cache_init(gb_memory *mem, const char *dir, int opt_level);
+
+/* load the block starting at addr in ROM bank from the cache */
+bool disk_cache_load(gb_block *block, uint8_t bank, uint16_t addr);
+
+/* keep a copy of a freshly translated ROM block for the cache file, before
+ * any of its exits is linked
+ */
+void disk_cache_record(const gb_block *block, uint8_t bank, uint16_t addr);
+
+/* write the cache file with the blocks of this run and close it */
+void disk_cache_close(void);
+
+#endif
@@ -1,13 +1,11 @@
 #ifndef JITBOY_EMIT_H
 #define JITBOY_EMIT_H
 
-#define DATA(X) ((gbz80_inst *) (X)->data)
-
-#include "glib.h"
-
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 
@@ -63,6 +61,8 @@ typedef struct {
         JP_TARGET,
         JP_BWD,
         JP_FWD,
+        COPY, /* runs a copy loop in bulk, see counter */
+        FILL, /* runs a fill loop in bulk, see counter */
         ERROR,
 #ifdef INSTRUCTION_TEST
         SET_F,
@@ -131,19 +131,170 @@ typedef struct {
         INST_FLAG_USES_CC = 0x04,
         INST_FLAG_AFFECTS_CC = 0x08,
         INST_FLAG_ENDS_BLOCK = 0x10,
-        INST_FLAG_SAVE_CC = 0x20,
-        INST_FLAG_RESTORE_CC = 0x40
+        /* flag producer and the conditional jump right behind it testing
+         * its result, emitted as one compare and branch
+         */
+        INST_FLAG_FUSED = 0x20
     } flags;
+    /* guest flags overwritten before anything reads them, GUEST_* */
+    uint8_t dead_flags;
+    /* guest registers neither read by the instruction nor live after it,
+     * GUEST_REG_*
+     */
+    uint8_t dead_regs;
+    /* COPY and FILL: register counting the loop iterations down, REG_B -
+     * REG_E, REG_BC or REG_DE
+     */
+    uint8_t counter;
 } gbz80_inst;
 
+/* guest flags, as they are laid out in F */
+#define GUEST_Z 0x80
+#define GUEST_N 0x40
+#define GUEST_H 0x20
+#define GUEST_C 0x10
+#define GUEST_FLAGS (GUEST_Z | GUEST_N | GUEST_H | GUEST_C)
+
+/* guest registers */
+#define GUEST_REG_A 0x01
+#define GUEST_REG_B 0x02
+#define GUEST_REG_C 0x04
+#define GUEST_REG_D 0x08
+#define GUEST_REG_E 0x10
+#define GUEST_REG_H 0x20
+#define GUEST_REG_L 0x40
+#define GUEST_REG_SP 0x80
+#define GUEST_REGS 0xff
+
+/* Instructions of the block being translated, in program order. Each thread
+ * keeps one array for all its translations, it only grows.
+ */
 typedef struct {
-    uint16_t (*func)(gb_state *);
+    gbz80_inst *inst;
+    unsigned count;
+    unsigned capacity;
+} gb_inst_array;
+
+/* make room for at least n instructions */
+static inline bool inst_array_reserve(gb_inst_array *a, unsigned n)
+{
+    if (n <= a->capacity)
+        return true;
+
+    unsigned capacity = a->capacity ? a->capacity : 64;
+    while (capacity < n)
+        capacity *= 2;
+    gbz80_inst *inst = realloc(a->inst, capacity * sizeof(gbz80_inst));
+    if (!inst) {
+        LOG_ERROR("could not allocate instruction array\n");
+        return false;
+    }
+    a->inst = inst;
+    a->capacity = capacity;
+    return true;
+}
+
+/* insert inst in front of position pos */
+static inline bool inst_array_insert(gb_inst_array *a,
+                                     unsigned pos,
+                                     gbz80_inst inst)
+{
+    if (!inst_array_reserve(a, a->count + 1))
+        return false;
+    memmove(&a->inst[pos + 1], &a->inst[pos],
+            (a->count - pos) * sizeof(gbz80_inst));
+    a->inst[pos] = inst;
+    a->count++;
+    return true;
+}
+
+/* drop n instructions starting at position pos */
+static inline void inst_array_remove(gb_inst_array *a, unsigned pos, unsigned n)
+{
+    memmove(&a->inst[pos], &a->inst[pos + n],
+            (a->count - pos - n) * sizeof(gbz80_inst));
+    a->count -= n;
+}
+
+typedef struct gb_block gb_block;
+
+/* Block exit with a static jump target. Once the successor is translated, the
+ * exit is patched into a direct jump to it, bypassing the dispatcher.
+ * Indirect jumps have a few of them as inline cache, each taking the first
+ * target it is linked to.
+ */
+typedef struct gb_link {
+    uint16_t target;
+    bool indirect; /* inline cache entry of an indirect jump */
+    uint8_t *jmp;  /* rel32 operand of the patchable jump */
+    uint8_t *bank; /* imm8 of the ROM bank guard, NULL for bank 0 targets */
+    uint8_t *key;  /* imm32 compared with gb_jump_key() for indirect ones */
+    gb_block *from, *to;
+    struct gb_link *next; /* next link into the same successor */
+} gb_link;
+
+#ifdef FASTMEM
+/* Guest store emitted as a plain host store into the fastmem mirror. Once it
+ * faults, it is redirected to its out-of-line gb_memory_write() call for good.
+ */
+typedef struct {
+    uint8_t *store; /* host store instruction */
+    uint8_t *stub;  /* slow path, continues behind the store */
+} gb_fastmem_site;
+#endif
+
+struct gb_block {
+    void *func; /* translated code, run with run_block() */
     unsigned exec_count;
-    uint16_t end_address;
+    bool untranslatable; /* compile() failed, the block is interpreted */
+    bool queued;         /* waiting for a compile worker */
+    uint16_t start_address, end_address;
     size_t size;
     void *mem;
-} gb_block;
+    gb_link *exits;
+    unsigned exit_count;
+    gb_link *incoming;
+    gb_block *next; /* next block in RAM block lists */
+#ifdef FASTMEM
+    gb_fastmem_site *sites;
+    unsigned site_count;
+#endif
+};
+
+/* generate the entry trampoline, once the code cache is set up */
+bool emit_init(void);
+
+/* run the translated block, returns the next guest pc */
+uint16_t run_block(gb_state *state, gb_block *block);
+
+/* translate the count instructions at insts into block */
+bool emit(gb_block *block, gbz80_inst *insts, unsigned count);
+
+/* release the translation state of the calling thread */
+void emit_free(void);
 
-bool emit(gb_block *block, GList *inst);
+/* print how much flag handling the liveness information saved */
+void emit_statistics(void);
+
+/* patch the exit link to jump directly into the translated block to, if it
+ * leads there
+ */
+void link_block(gb_link *link, gb_block *to, uint8_t bank);
+
+/* undo every link into and out of block, before its code is released */
+void unlink_block(gb_block *block);
+
+#ifdef FASTMEM
+/* install the handler redirecting faulting guest stores to their slow path */
+bool fastmem_init(void);
+
+/* make the store sites of block known to the fault handler, on the emulation
+ * thread once emit() is done
+ */
+bool fastmem_register(gb_block *block);
+
+/* forget the store sites of block, before its code is released */
+void fastmem_release(gb_block *block);
+#endif
 
 #endif
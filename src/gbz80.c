@@ -1,4 +1,5 @@
 #include <SDL.h>
+#include <inttypes.h>
 
 #include "gbz80.h"
 
@@ -534,18 +535,20 @@ static gbz80_inst cb_table[] = {
     /* clang-format on */
 };
 
-static bool optimize_cc(GList *inst)
+const gbz80_inst *gbz80_decode(const uint8_t *code)
 {
-    for (; inst; inst = inst->next) {
-        if (DATA(inst)->flags & INST_FLAG_AFFECTS_CC)
-            DATA(inst)->flags |= INST_FLAG_SAVE_CC;
+    return code[0] != 0xcb ? &inst_table[code[0]] : &cb_table[code[1]];
+}
 
-        if (DATA(inst)->flags & INST_FLAG_USES_CC)
-            DATA(inst)->flags |= INST_FLAG_RESTORE_CC;
-    }
+/* decoded instructions of the block being translated by this thread */
+static __thread gb_inst_array block_insts;
 
-    return true;
-}
+/* successful translations, updated by all compiling threads */
+static struct {
+    uint64_t blocks;
+    uint64_t bytes; /* guest code translated */
+    uint64_t time;  /* SDL_GetPerformanceCounter() ticks */
+} compile_stats;
 
 /* compiles block starting at start_address to gb_block */
 bool compile(gb_block *block,
@@ -555,11 +558,15 @@ bool compile(gb_block *block,
 {
     LOG_DEBUG("compile new block @%#x\n", start_address);
 
-    GList *instructions = NULL;
+    uint64_t start = SDL_GetPerformanceCounter();
+    gb_inst_array *instructions = &block_insts;
+    instructions->count = 0;
 
     uint16_t i = start_address;
     for (;;) {
-        gbz80_inst *inst = g_new(gbz80_inst, 1);
+        if (!inst_array_reserve(instructions, instructions->count + 1))
+            return false;
+        gbz80_inst *inst = &instructions->inst[instructions->count];
 
         uint8_t opcode = mem->mem[i];
         if (opcode != 0xcb) {
@@ -579,25 +586,49 @@ bool compile(gb_block *block,
         }
         LOG_DEBUG("inst: %i @%#x\n", inst->opcode, inst->address);
 
-        instructions = g_list_prepend(instructions, inst);
+        instructions->count++;
 
         if (inst->flags & INST_FLAG_ENDS_BLOCK)
             break;
     }
+    uint16_t bytes = i - start_address;
 
-    instructions = g_list_reverse(instructions);
-
-    if (!optimize_block(&instructions, opt_level))
+    if (!optimize_block(instructions, opt_level))
         return false;
 
-    if (!optimize_cc(instructions))
+    if (!emit(block, instructions->inst, instructions->count))
         return false;
 
-    bool result = emit(block, instructions);
+    uint64_t time = SDL_GetPerformanceCounter() - start;
+    __atomic_fetch_add(&compile_stats.blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compile_stats.bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compile_stats.time, time, __ATOMIC_RELAXED);
+    return true;
+}
 
-    g_list_free_full(instructions, g_free);
+void compile_statistics(void)
+{
+    uint64_t blocks = __atomic_load_n(&compile_stats.blocks, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&compile_stats.bytes, __ATOMIC_RELAXED);
+    double seconds = (double) __atomic_load_n(&compile_stats.time,
+                                              __ATOMIC_RELAXED) /
+                     SDL_GetPerformanceFrequency();
+    if (seconds == 0)
+        return;
+
+    printf("- translated %" PRIu64 " blocks, %" PRIu64 " bytes in %.3f ms\n",
+           blocks, bytes, seconds * 1000);
+    printf("- translation throughput: %.0f blocks/s, %.0f bytes/s\n",
+           blocks / seconds, bytes / seconds);
+    optimize_statistics();
+    emit_statistics();
+}
 
-    return result;
+void compile_free(void)
+{
+    free(block_insts.inst);
+    block_insts = (gb_inst_array){0};
+    emit_free();
 }
 
 #ifdef INSTRUCTION_TEST
@@ -606,16 +637,15 @@ struct instr_info compile_and_run(gb_block *block,
                                   uint16_t pc,
                                   uint8_t *flag_args)
 {
-    GList *instructions = NULL;
+    gbz80_inst instructions[2];
 
     /* run the fake instruction for flag setting */
-    gbz80_inst *inst_before = g_new(gbz80_inst, 1);
+    gbz80_inst *inst_before = &instructions[0];
     *inst_before = inst_table[0xfc];
     inst_before->args = flag_args;
     inst_before->address = -1;
-    instructions = g_list_prepend(instructions, inst_before);
 
-    gbz80_inst *inst = g_new(gbz80_inst, 1);
+    gbz80_inst *inst = &instructions[1];
 
     uint8_t opcode = mem->mem[pc];
     bool is_cb = false;
@@ -637,15 +667,7 @@ struct instr_info compile_and_run(gb_block *block,
         exit(1);
     }
 
-    instructions = g_list_prepend(instructions, inst);
-    instructions = g_list_reverse(instructions);
-
-    if (!optimize_cc(instructions)) {
-        exit(1);
-    }
-
-    bool result = emit(block, instructions);
-    g_list_free_full(instructions, g_free);
+    bool result = emit(block, instructions, 2);
 
     if (result == false) {
         LOG_ERROR("Fail to compile instruction\n");
@@ -662,22 +684,12 @@ struct instr_info compile_and_run(gb_block *block,
  */
 void build_load_flag_block(gb_block *block)
 {
-    GList *instructions = NULL;
-
     /* run the fake instruction for flag loading */
-    gbz80_inst *inst = g_new(gbz80_inst, 1);
-    *inst = inst_table[0xfd];
-    inst->args = NULL;
-    inst->address = -1;
-    instructions = g_list_prepend(instructions, inst);
-    instructions = g_list_reverse(instructions);
-
-    if (!optimize_cc(instructions)) {
-        exit(1);
-    }
+    gbz80_inst inst = inst_table[0xfd];
+    inst.args = NULL;
+    inst.address = -1;
 
-    bool result = emit(block, instructions);
-    g_list_free_full(instructions, g_free);
+    bool result = emit(block, &inst, 1);
 
     if (result == false) {
         LOG_ERROR("Fail to compile instruction\n");
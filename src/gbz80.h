@@ -9,7 +9,23 @@ bool compile(gb_block *block,
              uint16_t start_address,
              int opt_level);
 
-bool optimize_block(GList **instructions, int opt_level);
+/* run the optimization passes of opt_level over the block */
+bool optimize_block(gb_inst_array *instructions, int opt_level);
+
+/* print each block before and after the passes changing it to stdout */
+void optimize_dump(bool dump);
+
+/* print how many instructions each pass changed over all threads */
+void optimize_statistics(void);
+
+/* print the throughput of compile() over all threads */
+void compile_statistics(void);
+
+/* release the translation buffers of the calling thread */
+void compile_free(void);
+
+/* table entry of the instruction at code, args and address are not set */
+const gbz80_inst *gbz80_decode(const uint8_t *code);
 
 #ifdef INSTRUCTION_TEST
 struct instr_info {
@@ -0,0 +1,550 @@
+#include "interp.h"
+
+/* Game Boy flags in the layout of the host flags register, which translated
+ * code saves to state->flags: Z in ZF, H in AF and C in CF. N is kept in
+ * state->f_subtract.
+ */
+#define FLAG_C 0x01
+#define FLAG_H 0x10
+#define FLAG_Z 0x40
+
+static inline void set_flags(gb_state *state, bool z, bool n, bool h, bool c)
+{
+    state->flags = (state->flags & ~(uint64_t) (FLAG_Z | FLAG_H | FLAG_C)) |
+                   (z ? FLAG_Z : 0) | (h ? FLAG_H : 0) | (c ? FLAG_C : 0);
+    state->f_subtract = n;
+}
+
+static inline unsigned carry(const gb_state *state)
+{
+    return state->flags & FLAG_C ? 1 : 0;
+}
+
+static uint8_t *reg8(gb_state *state, int op)
+{
+    switch (op) {
+    case REG_A:
+        return &state->a;
+    case REG_B:
+        return &state->b;
+    case REG_C:
+        return &state->c;
+    case REG_D:
+        return &state->d;
+    case REG_E:
+        return &state->e;
+    case REG_H:
+        return &state->h;
+    default:
+        return &state->l;
+    }
+}
+
+static uint16_t get16(const gb_state *state, int op)
+{
+    switch (op) {
+    case REG_BC:
+        return state->b << 8 | state->c;
+    case REG_DE:
+        return state->d << 8 | state->e;
+    case REG_HL:
+        return state->h << 8 | state->l;
+    default:
+        return state->_sp;
+    }
+}
+
+static void set16(gb_state *state, int op, uint16_t value)
+{
+    switch (op) {
+    case REG_BC:
+        state->b = value >> 8;
+        state->c = value;
+        break;
+    case REG_DE:
+        state->d = value >> 8;
+        state->e = value;
+        break;
+    case REG_HL:
+        state->h = value >> 8;
+        state->l = value;
+        break;
+    default:
+        state->_sp = value;
+        break;
+    }
+}
+
+/* same fast path as the write_byte macro of the translated code */
+static void write_byte(gb_state *state, uint16_t addr, uint8_t value)
+{
+#ifdef INSTRUCTION_TEST
+    /* every write has to be reported to gbit */
+    gb_memory_write(state, addr, value);
+#else
+    if (addr >= 0x8000 && addr < 0xff00 && !state->code_map[addr - 0x8000])
+        state->mem->mem[addr] = value;
+    else
+        gb_memory_write(state, addr, value);
+#endif
+}
+
+static uint16_t mem_addr(const gb_state *state, int op, const uint8_t *args)
+{
+    switch (op) {
+    case MEM_BC:
+        return get16(state, REG_BC);
+    case MEM_DE:
+        return get16(state, REG_DE);
+    case MEM_16:
+        return args[2] << 8 | args[1];
+    case MEM_8:
+        return 0xff00 + args[1];
+    case MEM_C:
+        return 0xff00 + state->c;
+    default: /* MEM_HL, MEM_INC_HL, MEM_DEC_HL */
+        return get16(state, REG_HL);
+    }
+}
+
+static uint8_t load(gb_state *state, int op, const uint8_t *args)
+{
+    if (op >= REG_A && op <= REG_L)
+        return *reg8(state, op);
+    if (op == IMM8)
+        return args[1];
+    return state->mem->mem[mem_addr(state, op, args)];
+}
+
+static void store(gb_state *state, int op, const uint8_t *args, uint8_t value)
+{
+    if (op >= REG_A && op <= REG_L)
+        *reg8(state, op) = value;
+    else
+        write_byte(state, mem_addr(state, op, args), value);
+}
+
+/* post-increment/decrement of (HL+) and (HL-) */
+static void step_hl(gb_state *state, int op)
+{
+    if (op == MEM_INC_HL)
+        set16(state, REG_HL, get16(state, REG_HL) + 1);
+    else if (op == MEM_DEC_HL)
+        set16(state, REG_HL, get16(state, REG_HL) - 1);
+}
+
+static void push16(gb_state *state, uint16_t value)
+{
+    state->_sp -= 2;
+    write_byte(state, state->_sp + 1, value >> 8);
+    write_byte(state, state->_sp, value);
+}
+
+static uint16_t pop16(gb_state *state)
+{
+    uint8_t *mem = state->mem->mem;
+    uint16_t value = mem[(uint16_t) (state->_sp + 1)] << 8 | mem[state->_sp];
+    state->_sp += 2;
+    return value;
+}
+
+static bool condition(const gb_state *state, int op)
+{
+    switch (op) {
+    case CC_Z:
+        return state->flags & FLAG_Z;
+    case CC_NZ:
+        return !(state->flags & FLAG_Z);
+    case CC_C:
+        return state->flags & FLAG_C;
+    case CC_NC:
+        return !(state->flags & FLAG_C);
+    default:
+        return true;
+    }
+}
+
+static void alu_add(gb_state *state, uint8_t value, unsigned c)
+{
+    unsigned a = state->a, result = a + value + c;
+    set_flags(state, (uint8_t) result == 0, false,
+              (a & 0xf) + (value & 0xf) + c > 0xf, result > 0xff);
+    state->a = result;
+}
+
+static uint8_t alu_sub(gb_state *state, uint8_t value, unsigned c)
+{
+    int a = state->a, result = a - value - (int) c;
+    set_flags(state, (uint8_t) result == 0, true,
+              (a & 0xf) - (value & 0xf) - (int) c < 0, result < 0);
+    return result;
+}
+
+static void alu_logic(gb_state *state, uint8_t result, bool h)
+{
+    state->a = result;
+    set_flags(state, result == 0, false, h, false);
+}
+
+/* SP + e8 of ADD SP,e8 and LD HL,SP+e8, flags from the low byte */
+static uint16_t add_sp(gb_state *state, int8_t offset)
+{
+    uint16_t sp = state->_sp;
+    set_flags(state, false, false, (sp & 0xf) + (offset & 0xf) > 0xf,
+              (sp & 0xff) + (uint8_t) offset > 0xff);
+    return sp + offset;
+}
+
+/* result of a shift or rotation, only the CB prefixed forms set Z */
+static void shift_result(gb_state *state,
+                         const gbz80_inst *inst,
+                         const uint8_t *args,
+                         uint8_t result,
+                         bool c)
+{
+    store(state, inst->op1, args, result);
+    set_flags(state, args[0] == 0xcb && result == 0, false, false, c);
+}
+
+bool interpret(gb_state *state)
+{
+    /* clang-format off */
+    static const void *const dispatch[] = {
+        [NOP] = &&nop,     [LD16] = &&ld16,   [LD] = &&ld,
+        [INC16] = &&inc16, [INC] = &&inc,     [DEC16] = &&dec16,
+        [DEC] = &&dec,     [RLC] = &&rlc,     [RLCA] = &&rlc,
+        [ADD16] = &&add16, [ADD] = &&add,     [RRC] = &&rrc,
+        [RRCA] = &&rrc,    [STOP] = &&stop,   [RL] = &&rl,
+        [RLA] = &&rl,      [JR] = &&jump,     [RR] = &&rr,
+        [RRA] = &&rr,      [DAA] = &&daa,     [CPL] = &&cpl,
+        [SCF] = &&scf,     [CCF] = &&ccf,     [HALT] = &&halt,
+        [ADC] = &&adc,     [SUB] = &&sub,     [SBC] = &&sbc,
+        [AND] = &&and,     [XOR] = &&xor,     [OR] = &&or,
+        [CP] = &&cp,       [RET] = &&ret,     [POP] = &&pop,
+        [JP] = &&jump,     [CALL] = &&jump,   [PUSH] = &&push,
+        [RST] = &&jump,    [RETI] = &&ret,    [DI] = &&di,
+        [EI] = &&ei,       [SLA] = &&sla,     [SRA] = &&sra,
+        [SWAP] = &&swap,   [SRL] = &&srl,     [BIT] = &&bit,
+        [RES] = &&res,     [SET] = &&set,
+        /* only produced by optimize_block() */
+        [JP_TARGET] = &&invalid, [JP_BWD] = &&invalid,
+        [JP_FWD] = &&invalid,    [COPY] = &&invalid,
+        [FILL] = &&invalid,      [ERROR] = &&invalid,
+#ifdef INSTRUCTION_TEST
+        [SET_F] = &&invalid,     [LD_F] = &&invalid,
+#endif
+    };
+    /* clang-format on */
+
+    uint16_t pc = state->pc;
+    const gbz80_inst *inst;
+    const uint8_t *args;
+    uint8_t value;
+    uint16_t target;
+
+/* decode the instruction at pc and jump to its handler, in the view of the
+ * banks selected now
+ */
+#define DECODE()                               \
+    do {                                       \
+        args = state->mem->mem + pc;           \
+        inst = gbz80_decode(args);             \
+        pc += inst->bytes;                     \
+        state->inst_count += inst->cycles;     \
+        goto *dispatch[inst->opcode];          \
+    } while (0)
+
+#ifdef INSTRUCTION_TEST
+/* gbit steps single instructions, so each one ends the block */
+#define NEXT()            \
+    do {                  \
+        state->pc = pc;   \
+        return true;      \
+    } while (0)
+#else
+#define NEXT() DECODE()
+#endif
+
+/* continue behind a conditional jump that is not taken */
+#define NOT_TAKEN()                                             \
+    do {                                                        \
+        state->inst_count -= inst->cycles - inst->alt_cycles;  \
+        NEXT();                                                 \
+    } while (0)
+
+    DECODE();
+
+nop:
+    NEXT();
+
+ld16:
+    switch (inst->op1) {
+    case REG_HL:
+        if (inst->op2 == MEM_8)
+            set16(state, REG_HL, add_sp(state, args[1]));
+        else
+            set16(state, REG_HL, args[2] << 8 | args[1]);
+        break;
+    case REG_SP:
+        if (inst->op2 == REG_HL)
+            state->_sp = get16(state, REG_HL);
+        else
+            state->_sp = args[2] << 8 | args[1];
+        break;
+    case MEM_16:
+        target = mem_addr(state, MEM_16, args);
+        write_byte(state, target, state->_sp);
+        write_byte(state, target + 1, state->_sp >> 8);
+        break;
+    default:
+        set16(state, inst->op1, args[2] << 8 | args[1]);
+        break;
+    }
+    NEXT();
+
+ld:
+    store(state, inst->op1, args, load(state, inst->op2, args));
+    step_hl(state, inst->op1);
+    step_hl(state, inst->op2);
+    NEXT();
+
+inc16:
+    set16(state, inst->op1, get16(state, inst->op1) + 1);
+    NEXT();
+
+dec16:
+    set16(state, inst->op1, get16(state, inst->op1) - 1);
+    NEXT();
+
+inc:
+    value = load(state, inst->op1, args);
+    store(state, inst->op1, args, value + 1);
+    set_flags(state, value == 0xff, false, (value & 0xf) == 0xf,
+              carry(state));
+    NEXT();
+
+dec:
+    value = load(state, inst->op1, args);
+    store(state, inst->op1, args, value - 1);
+    set_flags(state, value == 0x01, true, (value & 0xf) == 0, carry(state));
+    NEXT();
+
+add16:
+    if (inst->op1 == REG_SP) {
+        state->_sp = add_sp(state, args[1]);
+    } else {
+        unsigned hl = get16(state, REG_HL), rr = get16(state, inst->op2);
+        set_flags(state, state->flags & FLAG_Z, false,
+                  (hl & 0xfff) + (rr & 0xfff) > 0xfff, hl + rr > 0xffff);
+        set16(state, REG_HL, hl + rr);
+    }
+    NEXT();
+
+add:
+    alu_add(state, load(state, inst->op2, args), 0);
+    NEXT();
+
+adc:
+    alu_add(state, load(state, inst->op2, args), carry(state));
+    NEXT();
+
+sub:
+    state->a = alu_sub(state, load(state, inst->op2, args), 0);
+    NEXT();
+
+sbc:
+    state->a = alu_sub(state, load(state, inst->op2, args), carry(state));
+    NEXT();
+
+cp:
+    alu_sub(state, load(state, inst->op2, args), 0);
+    NEXT();
+
+and:
+    alu_logic(state, state->a & load(state, inst->op2, args), true);
+    NEXT();
+
+xor:
+    alu_logic(state, state->a ^ load(state, inst->op2, args), false);
+    NEXT();
+
+or:
+    alu_logic(state, state->a | load(state, inst->op2, args), false);
+    NEXT();
+
+rlc:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value << 1 | value >> 7, value & 0x80);
+    NEXT();
+
+rrc:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value >> 1 | value << 7, value & 0x01);
+    NEXT();
+
+rl:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value << 1 | carry(state), value & 0x80);
+    NEXT();
+
+rr:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value >> 1 | carry(state) << 7,
+                 value & 0x01);
+    NEXT();
+
+sla:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value << 1, value & 0x80);
+    NEXT();
+
+sra:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, (value & 0x80) | value >> 1,
+                 value & 0x01);
+    NEXT();
+
+srl:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value >> 1, value & 0x01);
+    NEXT();
+
+swap:
+    value = load(state, inst->op1, args);
+    shift_result(state, inst, args, value << 4 | value >> 4, false);
+    NEXT();
+
+bit:
+    value = load(state, inst->op1, args);
+    set_flags(state, !(value & 1 << (inst->op2 - BIT_0)), false, true,
+              carry(state));
+    NEXT();
+
+res:
+    value = load(state, inst->op1, args);
+    store(state, inst->op1, args, value & ~(1 << (inst->op2 - BIT_0)));
+    NEXT();
+
+set:
+    value = load(state, inst->op1, args);
+    store(state, inst->op1, args, value | 1 << (inst->op2 - BIT_0));
+    NEXT();
+
+daa: {
+    unsigned a = state->a;
+    bool c = carry(state);
+    if (state->f_subtract) {
+        if (state->flags & FLAG_H)
+            a -= 0x06;
+        if (c)
+            a -= 0x60;
+    } else {
+        if (c || a > 0x99) {
+            a += 0x60;
+            c = true;
+        }
+        if ((state->flags & FLAG_H) || (a & 0x0f) > 0x09)
+            a += 0x06;
+    }
+    state->a = a;
+    set_flags(state, state->a == 0, state->f_subtract, false, c);
+    NEXT();
+}
+
+cpl:
+    state->a = ~state->a;
+    set_flags(state, state->flags & FLAG_Z, true, true, carry(state));
+    NEXT();
+
+scf:
+    set_flags(state, state->flags & FLAG_Z, false, false, true);
+    NEXT();
+
+ccf:
+    set_flags(state, state->flags & FLAG_Z, false, false, !carry(state));
+    NEXT();
+
+push:
+    if (inst->op1 == REG_AF)
+        push16(state, state->a << 8 | (state->flags & FLAG_Z ? 0x80 : 0) |
+                          (state->f_subtract ? 0x40 : 0) |
+                          (state->flags & FLAG_H ? 0x20 : 0) |
+                          (state->flags & FLAG_C ? 0x10 : 0));
+    else
+        push16(state, get16(state, inst->op1));
+    NEXT();
+
+pop:
+    target = pop16(state);
+    if (inst->op1 == REG_AF) {
+        state->a = target >> 8;
+        set_flags(state, target & 0x80, target & 0x40, target & 0x20,
+                  target & 0x10);
+    } else {
+        set16(state, inst->op1, target);
+    }
+    NEXT();
+
+di:
+    state->ime = false;
+    NEXT();
+
+/* instructions leaving the block, pc already points behind them */
+jump:
+    if (!condition(state, inst->op1))
+        NOT_TAKEN();
+    switch (inst->op2) {
+    case IMM8:
+        target = pc + (int8_t) args[1];
+        break;
+    case IMM16:
+        target = args[2] << 8 | args[1];
+        break;
+    case MEM_HL:
+        target = get16(state, REG_HL);
+        break;
+    default: /* RST */
+        target = (inst->op2 - MEM_0x00) * 0x08;
+        break;
+    }
+    if (inst->opcode == CALL || inst->opcode == RST) {
+        push16(state, pc);
+        gb_ras_push(state);
+    }
+    state->pc = target;
+    return true;
+
+ret:
+    if (!condition(state, inst->op1))
+        NOT_TAKEN();
+    if (inst->opcode == RETI)
+        state->ime = true;
+    state->pc = pop16(state);
+    gb_ras_pop(state);
+    return true;
+
+ei:
+    state->ime = true;
+    state->pc = pc;
+    return true;
+
+halt:
+    state->halt = 1;
+    state->pc = pc;
+    return true;
+
+stop:
+    /* like the translated code, stay on STOP until the halt ends */
+    state->halt = 1;
+    state->pc = pc - inst->bytes;
+    return true;
+
+invalid:
+    LOG_ERROR("Invalid Opcode! (%#x)\n", args[0]);
+    state->pc = pc - inst->bytes;
+    return false;
+
+#undef NOT_TAKEN
+#undef NEXT
+#undef DECODE
+}
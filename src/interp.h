@@ -0,0 +1,13 @@
+#ifndef JITBOY_INTERP_H
+#define JITBOY_INTERP_H
+
+#include "gbz80.h"
+
+/* Execute the block starting at state->pc without translating it and leave
+ * state->pc at the address to continue at. Interpreted and translated blocks
+ * work on the same gb_state, so either kind can run the next block. Returns
+ * false on an invalid opcode.
+ */
+bool interpret(gb_state *state);
+
+#endif
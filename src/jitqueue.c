@@ -0,0 +1,221 @@
+#include <SDL.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "jitqueue.h"
+
+static struct {
+    gb_memory *mem;
+    int opt_level;
+    SDL_Thread **threads;
+    int thread_count;
+
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    SDL_cond *idle; /* signalled when the last pending job is finished */
+    jit_job *pending, **pending_tail; /* FIFO, oldest first */
+    jit_job *done;
+    int busy; /* workers translating */
+    SDL_atomic_t done_count; /* polled by the emulation thread without lock */
+    bool quit;
+
+    /* statistics */
+    unsigned requests, published, depth, max_depth;
+    uint64_t publish_time, max_publish_time;
+} jq;
+
+/* Worker thread. ROM banks are switched while it translates, so it decodes
+ * from its own copy of bank 0, read by jit_queue_init() and passed in data,
+ * and the bank that was mapped when the block was requested.
+ */
+static int jit_worker(void *data)
+{
+    uint8_t *rom = data;
+    gb_memory view = {.mem = rom};
+    int mapped_bank = -1;
+
+    SDL_LockMutex(jq.lock);
+    for (;;) {
+        while (!jq.pending && !jq.quit)
+            SDL_CondWait(jq.wake, jq.lock);
+        if (jq.quit)
+            break;
+
+        jit_job *job = jq.pending;
+        jq.pending = job->next;
+        if (!jq.pending)
+            jq.pending_tail = &jq.pending;
+        jq.busy++;
+        SDL_UnlockMutex(jq.lock);
+
+        if (job->rom_bank != mapped_bank) {
+            memset(rom + 0x4000, 0, 0x4000);
+            if (pread(jq.mem->fd, rom + 0x4000, 0x4000,
+                      (off_t) job->rom_bank * 0x4000) < 0)
+                LOG_ERROR("compile worker could not read bank %i\n",
+                          job->rom_bank);
+            mapped_bank = job->rom_bank;
+        }
+        job->ok = compile(&job->result, &view, job->addr, jq.opt_level);
+
+        SDL_LockMutex(jq.lock);
+        job->next = jq.done;
+        jq.done = job;
+        SDL_AtomicAdd(&jq.done_count, 1);
+        if (--jq.busy == 0 && !jq.pending)
+            SDL_CondBroadcast(jq.idle);
+    }
+    SDL_UnlockMutex(jq.lock);
+
+    compile_free();
+    free(rom);
+    return 0;
+}
+
+bool jit_queue_init(gb_memory *mem, int threads, int opt_level)
+{
+    if (threads <= 0 || mem->fd < 0)
+        return true;
+
+    jq.mem = mem;
+    jq.opt_level = opt_level;
+    jq.pending = NULL;
+    jq.pending_tail = &jq.pending;
+    jq.lock = SDL_CreateMutex();
+    jq.wake = SDL_CreateCond();
+    jq.idle = SDL_CreateCond();
+    jq.threads = calloc(threads, sizeof(SDL_Thread *));
+    if (!jq.lock || !jq.wake || !jq.idle || !jq.threads) {
+        LOG_ERROR("could not create compile queue\n");
+        return false;
+    }
+
+    /* only workers that can take jobs are counted, so requests never wait
+     * for a worker that is gone
+     */
+    for (int i = 0; i < threads; ++i) {
+        uint8_t *rom = calloc(1, 0x10000);
+        if (!rom || pread(mem->fd, rom, 0x4000, 0) < 0) {
+            LOG_ERROR("compile worker could not read the ROM\n");
+            free(rom);
+            break;
+        }
+        jq.threads[i] = SDL_CreateThread(jit_worker, "Compile Worker", rom);
+        if (!jq.threads[i]) {
+            LOG_ERROR("could not start compile worker: %s\n", SDL_GetError());
+            free(rom);
+            break;
+        }
+        jq.thread_count++;
+    }
+    return jq.thread_count > 0;
+}
+
+bool jit_queue_request(gb_block *block, uint8_t bank, uint8_t rom_bank,
+                       uint16_t addr)
+{
+    if (jq.thread_count == 0)
+        return false;
+
+    jit_job *job = calloc(1, sizeof(jit_job));
+    if (!job)
+        return false;
+    job->block = block;
+    job->bank = bank;
+    job->rom_bank = rom_bank;
+    job->addr = addr;
+    job->requested = SDL_GetPerformanceCounter();
+    block->queued = true;
+
+    SDL_LockMutex(jq.lock);
+    *jq.pending_tail = job;
+    jq.pending_tail = &job->next;
+    SDL_CondSignal(jq.wake);
+    SDL_UnlockMutex(jq.lock);
+
+    jq.requests++;
+    if (++jq.depth > jq.max_depth)
+        jq.max_depth = jq.depth;
+    return true;
+}
+
+void jit_queue_wait(void)
+{
+    if (jq.thread_count == 0)
+        return;
+
+    SDL_LockMutex(jq.lock);
+    while (jq.pending || jq.busy > 0)
+        SDL_CondWait(jq.idle, jq.lock);
+    SDL_UnlockMutex(jq.lock);
+}
+
+jit_job *jit_queue_finished(void)
+{
+    if (jq.thread_count == 0 || SDL_AtomicGet(&jq.done_count) == 0)
+        return NULL;
+
+    SDL_LockMutex(jq.lock);
+    jit_job *jobs = jq.done;
+    jq.done = NULL;
+    SDL_AtomicSet(&jq.done_count, 0);
+    SDL_UnlockMutex(jq.lock);
+
+    uint64_t now = SDL_GetPerformanceCounter();
+    for (jit_job *job = jobs; job; job = job->next) {
+        uint64_t time = now - job->requested;
+        jq.publish_time += time;
+        if (time > jq.max_publish_time)
+            jq.max_publish_time = time;
+        jq.published++;
+        jq.depth--;
+    }
+    return jobs;
+}
+
+void jit_queue_statistics(void)
+{
+    if (jq.thread_count == 0)
+        return;
+
+    double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    printf("- compile queue: %i workers, %u requests, max depth %u\n",
+           jq.thread_count, jq.requests, jq.max_depth);
+    printf("- time to publish avg / max: %.3f / %.3f ms\n",
+           jq.published ? jq.publish_time * ms / jq.published : 0.0,
+           jq.max_publish_time * ms);
+}
+
+static void free_jobs(jit_job *job, bool translated)
+{
+    while (job) {
+        jit_job *next = job->next;
+        if (translated && job->ok)
+            free_block(&job->result);
+        free(job);
+        job = next;
+    }
+}
+
+void jit_queue_close(void)
+{
+    if (jq.thread_count == 0)
+        return;
+
+    SDL_LockMutex(jq.lock);
+    jq.quit = true;
+    SDL_CondBroadcast(jq.wake);
+    SDL_UnlockMutex(jq.lock);
+    for (int i = 0; i < jq.thread_count; ++i)
+        SDL_WaitThread(jq.threads[i], NULL);
+
+    free_jobs(jq.pending, false);
+    free_jobs(jq.done, true);
+    free(jq.threads);
+    SDL_DestroyCond(jq.idle);
+    SDL_DestroyCond(jq.wake);
+    SDL_DestroyMutex(jq.lock);
+    memset(&jq, 0, sizeof(jq));
+}
@@ -0,0 +1,50 @@
+#ifndef JITBOY_JITQUEUE_H
+#define JITBOY_JITQUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "emit.h"
+#include "memory.h"
+
+/* Request to translate a ROM block on a compile worker */
+typedef struct jit_job {
+    gb_block *block;    /* table entry, interpreted until the result is in */
+    gb_block result;    /* translation, valid if ok */
+    bool ok;
+    uint8_t bank;       /* bank of the block */
+    uint8_t rom_bank;   /* bank mapped at 0x4000 when it was requested */
+    uint16_t addr;
+    uint64_t requested; /* SDL_GetPerformanceCounter() */
+    struct jit_job *next;
+} jit_job;
+
+/* upper bound of the --jit-threads option */
+#define JIT_MAX_THREADS 64
+
+/* Start threads compile workers translating the ROM of mem with opt_level.
+ * Without workers, blocks are translated by the emulation thread.
+ */
+bool jit_queue_init(gb_memory *mem, int threads, int opt_level);
+
+/* Queue the translation of block at addr in bank, decoded with rom_bank
+ * mapped at 0x4000. Returns false if there are no workers, the caller has to
+ * translate the block itself then.
+ */
+bool jit_queue_request(gb_block *block, uint8_t bank, uint8_t rom_bank,
+                       uint16_t addr);
+
+/* block until all requested translations are finished */
+void jit_queue_wait(void);
+
+/* Translations finished since the last call, NULL if there are none. The
+ * caller installs them into their blocks and frees the jobs.
+ */
+jit_job *jit_queue_finished(void);
+
+void jit_queue_statistics(void);
+
+/* stop the workers and drop all requests and unpublished translations */
+void jit_queue_close(void);
+
+#endif
@@ -1,9 +1,12 @@
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #include "core.h"
+#include "diskcache.h"
+#include "jitqueue.h"
 #include "save.h"
 
 static void usage(const char *exe)
@@ -14,10 +17,32 @@ static void usage(const char *exe)
         "  -O, --opt-level=LEVEL   Set the optimization level (default: 0)\n"
         "  -s, --scale=SCALE       Set the scale of the window (default: 3)\n"
         "  -t, --turbo             Run in turbo mode\n"
-        "      --no-sound          Disable audio initialization\n",
+        "      --no-sound          Disable audio initialization\n"
+        "      --cache=DIR         Keep translated ROM code in DIR across runs\n"
+        "      --jit-threshold=N   Interpret ROM blocks N times before\n"
+        "                          translating them (default: 2)\n"
+        "      --jit-threads=N     Translate on N background threads (at most 64),\n"
+        "                          0 to translate on the emulation thread\n"
+        "                          (default: 1)\n"
+        "      --aot               Translate the code found in the ROM before\n"
+        "                          starting, on at least one worker per CPU\n"
+        "                          (at most 64), needs --jit-threads above 0\n"
+        "      --dump-ir           Print every translated block before and\n"
+        "                          after each optimization pass changing it\n",
         exe);
 }
 
+/* parse the integer option arg into value, false if it is not in [min, max] */
+static bool parse_int(const char *arg, int min, int max, int *value)
+{
+    int v;
+    char junk;
+    if (sscanf(arg, "%i %c", &v, &junk) != 1 || v < min || v > max)
+        return false;
+    *value = v;
+    return true;
+}
+
 static void banner()
 {
 #define ENDL "\n"
@@ -54,6 +79,11 @@ int main(int argc, char *argv[])
     int scale = 3;
     int turbo = false;
     int init_sound = true;
+    const char *cache_dir = NULL;
+    int jit_threshold = DEFAULT_JIT_THRESHOLD;
+    int jit_threads = 1;
+    int aot = false;
+    int dump_ir = false;
 
     int c;
     const struct option long_options[] = {
@@ -61,6 +91,11 @@ int main(int argc, char *argv[])
         {"scale", required_argument, NULL, 's'},
         {"turbo", no_argument, NULL, 't'},
         {"no-sound", no_argument, NULL, 'a'},
+        {"cache", required_argument, NULL, 'c'},
+        {"jit-threshold", required_argument, NULL, 'j'},
+        {"jit-threads", required_argument, NULL, 'w'},
+        {"aot", no_argument, NULL, 'A'},
+        {"dump-ir", no_argument, NULL, 'd'},
         {NULL, 0, NULL, 0}  // Terminating element
     };
 
@@ -78,6 +113,34 @@ int main(int argc, char *argv[])
         case 'a':
             init_sound = false;
             break;
+        case 'c':
+            if (!*optarg) {
+                fprintf(stderr, "--cache needs a directory\n");
+                usage(argv[0]);
+                return -1;
+            }
+            cache_dir = optarg;
+            break;
+        case 'j':
+            if (!parse_int(optarg, 0, INT_MAX, &jit_threshold)) {
+                fprintf(stderr, "invalid --jit-threshold: %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'w':
+            if (!parse_int(optarg, 0, JIT_MAX_THREADS, &jit_threads)) {
+                fprintf(stderr, "invalid --jit-threads: %s\n", optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'A':
+            aot = true;
+            break;
+        case 'd':
+            dump_ir = true;
+            break;
         case '?':
         default:
             usage(argv[0]);
@@ -94,6 +157,20 @@ int main(int argc, char *argv[])
         opt_level = 3;
     if (opt_level < 0)
         opt_level = 0;
+    if (aot) {
+        /* ahead of time translation only runs on compile workers */
+        if (jit_threads == 0) {
+            fprintf(stderr, "--aot cannot be used with --jit-threads=0\n");
+            usage(argv[0]);
+            return -1;
+        }
+        int cpus = SDL_GetCPUCount();
+        if (cpus > JIT_MAX_THREADS)
+            cpus = JIT_MAX_THREADS;
+        if (jit_threads < cpus)
+            jit_threads = cpus;
+    }
+    optimize_dump(dump_ir);
 
     /* initialize memory */
     gb_vm *vm = malloc(sizeof(gb_vm));
@@ -101,6 +178,13 @@ int main(int argc, char *argv[])
         LOG_ERROR("Fail to initialize\n");
         exit(1);
     }
+    vm->jit_threshold = jit_threshold;
+    if (!jit_queue_init(&vm->memory, jit_threads, opt_level))
+        LOG_ERROR("Translating on the emulation thread\n");
+    if (!disk_cache_init(&vm->memory, cache_dir, opt_level))
+        LOG_ERROR("Translation cache disabled\n");
+    if (aot && !translate_rom_ahead(vm))
+        LOG_ERROR("Translating the remaining ROM code on demand\n");
 
     banner();
 #ifdef DEBUG
@@ -18,12 +18,94 @@
 #include "tests/instr_test.h"
 #endif
 
-void gb_memory_ram_flush(gb_memory *mem)
+/* layout of the RAM memfd */
+#define RAM_VRAM 0x0000  /* 0x8000 - 0x9fff */
+#define RAM_WRAM 0x2000  /* 0xc000 - 0xffff */
+#define RAM_BANKS 0x6000 /* cartridge RAM banks, then the RTC registers */
+#define RAM_SIZE (RAM_BANKS + (MAX_RAM_BANKS + 1) * 0x2000)
+
+/* RAM bank of the views while the RTC registers are selected */
+#define RTC_BANK MAX_RAM_BANKS
+
+#ifdef FASTMEM
+#define VIEW_SIZE (FASTMEM_MIRROR + 0x10000)
+#else
+#define VIEW_SIZE 0x10000
+#endif
+
+/* map 0x8000 - 0xffff with cartridge RAM ram_bank to at */
+static bool map_ram(gb_memory *mem, uint8_t *at, int ram_bank, int io_prot)
 {
-    memcpy(mem->ram_banks + mem->current_ram_bank * 0x2000, mem->mem + 0xa000,
-           0x2000);
+    const int rw = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_FIXED;
+    return mmap(at, 0x2000, rw, flags, mem->ram_fd, RAM_VRAM) != MAP_FAILED &&
+           mmap(at + 0x2000, 0x2000, rw, flags, mem->ram_fd,
+                RAM_BANKS + ram_bank * 0x2000) != MAP_FAILED &&
+           mmap(at + 0x4000, 0x3000, rw, flags, mem->ram_fd, RAM_WRAM) !=
+               MAP_FAILED &&
+           mmap(at + 0x7000, 0x1000, io_prot, flags, mem->ram_fd,
+                RAM_WRAM + 0x3000) != MAP_FAILED;
 }
 
+/* Build the view for the banks on first use. Translated code keeps using the
+ * view in aMem until it calls into C, see call_write_handler.
+ */
+static uint8_t *map_view(gb_memory *mem, int rom_bank, int ram_bank)
+{
+    uint8_t **view = &mem->views[rom_bank * (MAX_RAM_BANKS + 1) + ram_bank];
+    if (*view)
+        return *view;
+
+    uint8_t *base = mmap(NULL, VIEW_SIZE, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("could not map banks %i / %i (%i)\n", rom_bank, ram_bank,
+                  errno);
+        return NULL;
+    }
+
+    bool ok = mmap(base, 0x4000, PROT_READ, MAP_PRIVATE | MAP_FIXED, mem->fd,
+                   0) != MAP_FAILED &&
+              mmap(base + 0x4000, 0x4000, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                   mem->fd, 0x4000 * rom_bank) != MAP_FAILED &&
+              map_ram(mem, base + 0x8000, ram_bank, PROT_READ | PROT_WRITE);
+#ifdef FASTMEM
+    /* ROM stays inaccessible in the mirror */
+    ok = ok && map_ram(mem, base + FASTMEM_MIRROR + 0x8000, ram_bank,
+                       PROT_READ);
+    for (int page = 0x8; ok && page < 0xf; ++page) {
+        if (mem->ro_pages & 1 << page)
+            ok = mprotect(base + FASTMEM_MIRROR + page * 0x1000, 0x1000,
+                          PROT_READ) == 0;
+    }
+#endif
+    if (!ok) {
+        LOG_ERROR("could not map banks %i / %i (%i)\n", rom_bank, ram_bank,
+                  errno);
+        munmap(base, VIEW_SIZE);
+        return NULL;
+    }
+
+    mem->view_list[mem->view_count++] = base;
+    *view = base;
+    return base;
+}
+
+#ifdef FASTMEM
+void gb_memory_protect_page(gb_memory *mem, uint16_t addr, int prot)
+{
+    unsigned page = addr / 0x1000;
+    uint16_t ro_pages = prot & PROT_WRITE ? mem->ro_pages & ~(1 << page)
+                                          : mem->ro_pages | 1 << page;
+    if (ro_pages == mem->ro_pages)
+        return;
+    mem->ro_pages = ro_pages;
+
+    for (unsigned i = 0; i < mem->view_count; ++i)
+        mprotect(mem->view_list[i] + FASTMEM_MIRROR + page * 0x1000, 0x1000,
+                 prot);
+}
+#endif
+
 static uint8_t get_joypad_state(gb_keys *keys, uint8_t value)
 {
     uint8_t result = 0;
@@ -35,42 +117,58 @@ static uint8_t get_joypad_state(gb_keys *keys, uint8_t value)
 }
 
 /* change RAM bank to bank if supported */
-static void gb_memory_change_ram_bank(gb_memory *mem, int bank)
+static void gb_memory_change_ram_bank(gb_state *state, int bank)
 {
-    if (mem->current_ram_bank == bank)
+    gb_memory *mem = state->mem;
+    bank &= MAX_RAM_BANKS - 1;
+    if (mem->current_ram_bank == bank && !mem->rtc_access)
         return;
 
-    if (!mem->rtc_access) {
-        gb_memory_ram_flush(mem);
-    }
-    memcpy(mem->mem + 0xa000, mem->ram_banks + bank * 0x2000, 0x2000);
-    mem->rtc_access = false;
+    invalidate_ram_blocks((gb_vm *) state, 0xa000, 0xbfff);
 
+    uint8_t *view = map_view(mem, mem->current_rom_bank, bank);
+    if (!view)
+        return;
+
+    mem->mem = view;
+    mem->rtc_access = false;
     mem->current_ram_bank = bank;
 }
 
+/* drop translated code at addr before it is overwritten */
+static inline void gb_memory_check_code(gb_state *state, uint16_t addr)
+{
+    if (addr >= 0x8000 && state->code_map[addr - 0x8000])
+        invalidate_ram_blocks((gb_vm *) state, addr, addr);
+}
+
 /* change ROM bank to bank if supported */
 static void gb_memory_change_rom_bank(gb_memory *mem, int bank)
 {
+    bank %= mem->rom_bank_count; /* larger numbers wrap around */
     if (mem->current_rom_bank == bank)
         return;
 
-    if (munmap(mem->mem + 0x4000, 0x4000) != 0) {
-        LOG_ERROR("munmap failed (%i)\n", errno);
+    uint8_t *view = map_view(mem, bank,
+                             mem->rtc_access ? RTC_BANK : mem->current_ram_bank);
+    if (!view)
         return;
-    }
-
-    if (mmap(mem->mem + 0x4000, 0x4000, PROT_READ, MAP_PRIVATE | MAP_FIXED,
-             mem->fd, 0x4000 * bank) == MAP_FAILED) {
-        LOG_ERROR("mmap failed! (%i)\n", errno);
-        return;
-    }
 
+    mem->mem = view;
     mem->current_rom_bank = bank;
 }
 
-static void gb_memory_access_rtc(gb_memory *mem, int elt)
+static void gb_memory_access_rtc(gb_state *state, int elt)
 {
+    gb_memory *mem = state->mem;
+    if (!mem->rtc_access) {
+        invalidate_ram_blocks((gb_vm *) state, 0xa000, 0xbfff);
+        uint8_t *view = map_view(mem, mem->current_rom_bank, RTC_BANK);
+        if (!view)
+            return;
+        mem->mem = view;
+    }
+
     /* FIXME: implement RTC */
     mem->mem[0xa000] = 0;
     mem->rtc_access = true;
@@ -81,6 +179,224 @@ static void gb_memory_update_rtc_time(gb_memory *mem, int value)
     /* FIXME: implement RTC time */
 }
 
+#ifndef INSTRUCTION_TEST
+/* 0x0000 - 0x1fff: external RAM enable, RAM is always accessible */
+static void gb_memory_write_ram_enable(gb_state *state,
+                                       uint64_t addr,
+                                       uint64_t value)
+{
+    LOG_DEBUG("write to rom @address %#" PRIx64 ", value is %#" PRIx64 "\n",
+              addr, value & 0xff);
+}
+
+/* 0x2000 - 0x3fff: ROM bank number */
+static void gb_memory_write_rom_bank(gb_state *state,
+                                     uint64_t addr,
+                                     uint64_t value)
+{
+    int bank;
+    value &= 0xff;
+
+    switch (state->mem->mbc) {
+    case MBC_NONE:
+        return;
+    case MBC2_BAT:
+    case MBC2:
+    case MBC1_RAM_BAT:
+    case MBC1:
+        bank = (value & 0x1f) |
+               (state->mem->mbc_mode ? 0 : (state->mem->mbc_data & 0x60));
+        if ((bank & 0x1f) == 0)
+            bank |= 1;
+        break;
+    case MBC3_TIMER_RAM_BAT:
+    case MBC3_RAM_BAT:
+    case MBC3:
+        bank = (value & 0x7f);
+        if (bank == 0)
+            bank = 1;
+        break;
+    case MBC5_RAM_BAT:
+    case MBC5:
+        bank = value;
+        break;
+    default:
+        LOG_ERROR("Unknown MBC, cannot switch bank\n");
+        return;
+    }
+
+    LOG_DEBUG("change rom bank to %i\n", bank);
+    gb_memory_change_rom_bank(state->mem, bank);
+}
+
+/* 0x4000 - 0x5fff: RAM bank number or upper ROM bank bits */
+static void gb_memory_write_ram_bank(gb_state *state,
+                                     uint64_t addr,
+                                     uint64_t value)
+{
+    value &= 0xff;
+
+    switch (state->mem->mbc) {
+    case MBC_NONE:
+        break;
+    case MBC2_BAT:
+    case MBC2:
+    case MBC1_RAM_BAT:
+    case MBC1:
+        if (state->mem->mbc_mode) {
+            gb_memory_change_ram_bank(state, value);
+        } else {
+            state->mem->mbc_data = value << 5;
+        }
+        break;
+    case MBC3_TIMER_RAM_BAT:
+    case MBC3_RAM_BAT:
+    case MBC3:
+        if (value < 4) {
+            gb_memory_change_ram_bank(state, value);
+        } else if (value >= 8 && value < 13) {
+            gb_memory_access_rtc(state, value);
+        } else {
+            LOG_DEBUG("failed to change ram bank to %" PRIu64 "\n", value);
+        }
+        break;
+    case MBC5_RAM_BAT:
+    case MBC5:
+        gb_memory_change_ram_bank(state, value & 0xf);
+        break;
+    default:
+        LOG_ERROR("Unknown MBC, cannot switch bank\n");
+        break;
+    }
+}
+
+/* 0x6000 - 0x7fff: banking mode or RTC latch */
+static void gb_memory_write_mbc_mode(gb_state *state,
+                                     uint64_t addr,
+                                     uint64_t value)
+{
+    value &= 0xff;
+
+    switch (state->mem->mbc) {
+    case MBC_NONE:
+        break;
+    case MBC2_BAT:
+    case MBC2:
+    case MBC1_RAM_BAT:
+    case MBC1:
+        state->mem->mbc_mode = value & 0x01;
+        break;
+    case MBC3_TIMER_RAM_BAT:
+    case MBC3_RAM_BAT:
+    case MBC3:
+        gb_memory_update_rtc_time(state->mem, value);
+        break;
+    case MBC5_RAM_BAT:
+    case MBC5:
+        /* MBC5 decodes the whole 0x4000 - 0x7fff range as RAM bank */
+        gb_memory_change_ram_bank(state, value & 0xf);
+        break;
+    default:
+        LOG_ERROR("Unknown MBC, cannot switch bank\n");
+        break;
+    }
+}
+
+/* 0xff00: check for keypresses */
+static void gb_memory_write_joypad(gb_state *state,
+                                   uint64_t addr,
+                                   uint64_t value)
+{
+    LOG_DEBUG("Reading joypad state @%4x\n", state->pc);
+    state->mem->mem[0xff00] = get_joypad_state(&state->keys, value & 0xff);
+}
+
+/* 0xff01: serial transfer data, no link cable attached */
+static void gb_memory_write_serial(gb_state *state,
+                                   uint64_t addr,
+                                   uint64_t value)
+{
+    LOG_DEBUG("Writing serial transfer data @%4x\n", state->pc);
+}
+
+/* 0xff05: timer counter */
+static void gb_memory_write_tima(gb_state *state, uint64_t addr, uint64_t value)
+{
+    LOG_DEBUG("Memory write to %#" PRIx64 ", reset to 0\n", addr);
+    state->mem->mem[0xff05] = 0;
+}
+
+/* 0xff10 - 0xff3f: audio update */
+static void gb_memory_write_audio(gb_state *state,
+                                  uint64_t addr,
+                                  uint64_t value)
+{
+    addr &= 0xffff;
+    value &= 0xff;
+    LOG_DEBUG("Memory write to %#" PRIx64 ", value is %#" PRIx64 "\n", addr,
+              value);
+
+    lock_audio_dev();
+    channel_update(addr, value);
+    state->mem->mem[addr] = value;
+    unlock_audio_dev();
+}
+
+/* 0xff46: DMA Transfer to OAM RAM */
+static void gb_memory_write_dma(gb_state *state, uint64_t addr, uint64_t value)
+{
+    uint8_t *mem = state->mem->mem;
+    value &= 0xff;
+
+    /* Detect jumps in the RAM and optimize DMA */
+    LOG_DEBUG("DMA Transfer started.\n");
+    mem[0xff46] = value;
+    memcpy(&mem[0xfe00], &mem[value << 8], 0xa0);
+}
+
+/* 0xff80 - 0xffff: write to internal ram */
+static void gb_memory_write_hram(gb_state *state, uint64_t addr, uint64_t value)
+{
+    addr &= 0xffff;
+    gb_memory_check_code(state, addr);
+    state->mem->mem[addr] = value & 0xff;
+}
+#endif
+
+gb_write_handler gb_memory_write_handler(uint16_t addr)
+{
+#ifdef INSTRUCTION_TEST
+    /* every write has to be reported to gbit */
+    return gb_memory_write;
+#else
+    if (addr < 0x2000)
+        return gb_memory_write_ram_enable;
+    if (addr < 0x4000)
+        return gb_memory_write_rom_bank;
+    if (addr < 0x6000)
+        return gb_memory_write_ram_bank;
+    if (addr < 0x8000)
+        return gb_memory_write_mbc_mode;
+    if (addr >= 0xff80)
+        return gb_memory_write_hram;
+    if (addr >= 0xff10 && addr <= 0xff3f)
+        return gb_memory_write_audio;
+
+    switch (addr) {
+    case 0xff00:
+        return gb_memory_write_joypad;
+    case 0xff01:
+        return gb_memory_write_serial;
+    case 0xff05:
+        return gb_memory_write_tima;
+    case 0xff46:
+        return gb_memory_write_dma;
+    default:
+        return NULL;
+    }
+#endif
+}
+
 /* emulate write through mbc */
 void gb_memory_write(gb_state *state, uint64_t addr, uint64_t value)
 {
@@ -90,126 +406,113 @@ void gb_memory_write(gb_state *state, uint64_t addr, uint64_t value)
 #ifdef INSTRUCTION_TEST
     /* extra write for gbit*/
     gbz80_mmu_write(addr, value);
+    state->mem->mem[addr] = value;
+#else
+    gb_write_handler handler = gb_memory_write_handler(addr);
+    if (handler) {
+        handler(state, addr, value);
+    } else {
+        LOG_DEBUG("Memory write to %#" PRIx64 ", value is %#" PRIx64 "\n", addr,
+                  value);
+        gb_memory_check_code(state, addr);
+        state->mem->mem[addr] = value;
+    }
 #endif
+}
 
-    uint8_t *mem = state->mem->mem;
+/* Bytes from addr on, walking by step, that plain stores may write: up to
+ * the I/O registers, ROM or translated code, or n.
+ */
+static unsigned gb_memory_plain_run(gb_state *state,
+                                    uint16_t addr,
+                                    int step,
+                                    unsigned n)
+{
 #ifdef INSTRUCTION_TEST
-    mem[addr] = value;
+    /* every write has to be reported to gbit */
+    return 0;
 #else
-    if (addr < 0x8000) {
-        LOG_DEBUG("write to rom @address %#" PRIx64 ", value is %#" PRIx64 "\n",
-                  addr, value);
-
-        switch (state->mem->mbc) {
-        case MBC_NONE:
-            break;
-        case MBC2_BAT:
-        case MBC2:
-        case MBC1_RAM_BAT:
-        case MBC1:
-            if (addr >= 0x6000) {
-                state->mem->mbc_mode = value & 0x01;
-            } else if (addr >= 0x4000) {
-                if (state->mem->mbc_mode) {
-                    gb_memory_change_ram_bank(state->mem, value);
-                } else {
-                    state->mem->mbc_data = value << 5;
-                }
-            } else if (addr >= 0x2000) {
-                int bank =
-                    (value & 0x1f) |
-                    (state->mem->mbc_mode ? 0 : (state->mem->mbc_data & 0x60));
-
-                if ((bank & 0x1f) == 0)
-                    bank |= 1;
-
-                LOG_DEBUG("change rom bank to %i\n", bank);
-                gb_memory_change_rom_bank(state->mem, bank);
-            }
+    unsigned i = 0;
+    for (uint16_t a = addr; i < n; ++i, a += step) {
+        if (a < 0x8000 || a >= 0xff00 || state->code_map[a - 0x8000])
             break;
-        case MBC3_TIMER_RAM_BAT:
-        case MBC3_RAM_BAT:
-        case MBC3:
-            if (addr >= 0x6000) {
-                gb_memory_update_rtc_time(state->mem, value);
-            } else if (addr >= 0x4000) {
-                if (value < 4) {
-                    gb_memory_change_ram_bank(state->mem, value);
-                } else if (value >= 8 && value < 13) {
-                    gb_memory_access_rtc(state->mem, value);
-                } else {
-                    LOG_DEBUG("failed to change ram bank to %i\n", value);
-                }
-            } else if (addr >= 0x2000) {
-                int bank = (value & 0x7f);
-                if (bank == 0)
-                    bank = 1;
-
-                LOG_DEBUG("change rom bank to %i\n", bank);
-                gb_memory_change_rom_bank(state->mem, bank);
-            }
-            break;
-        case MBC5_RAM_BAT:
-        case MBC5:
-            if (addr >= 0x4000) {
-                int bank = (value & 0xf);
-                gb_memory_change_ram_bank(state->mem, bank);
-            } else if (addr >= 0x2000) {
-                int bank = value;
-
-                LOG_DEBUG("change rom bank to %i\n", bank);
-                gb_memory_change_rom_bank(state->mem, bank);
-            }
-            break;
-        default:
-            LOG_ERROR("Unknown MBC, cannot switch bank\n");
-            break;
-        }
-    } else if (addr == 0xff05) {
-        LOG_DEBUG("Memory write to %#" PRIx64 ", reset to 0\n", addr);
-        mem[addr] = 0;
-    } else if (addr == 0xff00) { /* check for keypresses */
-        LOG_DEBUG("Reading joypad state @%4x\n", state->pc);
-        mem[addr] = get_joypad_state(&state->keys, value);
-    } else if (addr == 0xff01) {
-        LOG_DEBUG("Writing serial transfer data @%4x\n", state->pc);
-    } else if (addr == 0xff46) { /* DMA Transfer to OAM RAM */
-                                 /* Detect jumps in the RAM and optimize DMA */
-        LOG_DEBUG("DMA Transfer started.\n");
-        mem[addr] = value;
-        memcpy(&mem[0xfe00], &mem[value << 8], 0xa0);
-    } else if (addr >= 0xff80) { /* write to internal ram */
-        gb_vm *vm = (gb_vm *) state;
-
-        /* invalidate compiled blocks */
-        for (unsigned i = 0; i < addr - 0xff80; ++i) {
-            if (vm->highmem_blocks[i].exec_count != 0 &&
-                vm->highmem_blocks[i].end_address > addr) {
-                free_block(&vm->highmem_blocks[i]);
-                vm->highmem_blocks[i].exec_count = 0;
-            }
-        }
-
-        mem[addr] = value;
-    } else if (addr >= 0xff10 && addr <= 0xff3f) { /* audio update */
-        LOG_DEBUG("Memory write to %#" PRIx64 ", value is %#" PRIx64 "\n", addr,
-                  value);
-
-        lock_audio_dev();
-        channel_update(addr, value);
-        mem[addr] = value;
-        unlock_audio_dev();
-    } else {
-        LOG_DEBUG("Memory write to %#" PRIx64 ", value is %#" PRIx64 "\n", addr,
-                  value);
-        mem[addr] = value;
     }
+    return i;
 #endif
 }
 
+uint64_t gb_memory_copy(gb_state *state,
+                        uint64_t dst,
+                        uint64_t src,
+                        uint64_t n)
+{
+    dst &= 0xffff;
+    src &= 0xffff;
+    n = gb_memory_plain_run(state, dst, 1, n);
+    if (src + n > 0x10000)
+        n = 0x10000 - src;
+    /* byte by byte, a destination just above the source repeats the bytes
+     * copied first
+     */
+    if (dst > src && dst < src + n)
+        n = dst - src;
+
+    uint8_t *mem = state->mem->mem;
+    memmove(&mem[dst], &mem[src], n);
+    return n;
+}
+
+uint64_t gb_memory_fill(gb_state *state,
+                        uint64_t dst,
+                        uint64_t value,
+                        uint64_t n,
+                        int64_t step)
+{
+    dst &= 0xffff;
+    n = gb_memory_plain_run(state, dst, step, n);
+
+    uint8_t *mem = state->mem->mem;
+    memset(&mem[step > 0 ? dst : dst + 1 - n], value & 0xff, n);
+    return n;
+}
+
+/* release the mappings and files of a ROM, as far as gb_memory_init() got */
+static bool gb_memory_release(gb_memory *mem)
+{
+    bool ok = true;
+    if (mem->ram_banks && mem->ram_banks != MAP_FAILED)
+        ok = munmap(mem->ram_banks, MAX_RAM_BANKS * 0x2000) == 0;
+    for (unsigned i = 0; i < mem->view_count; ++i)
+        ok = munmap(mem->view_list[i], VIEW_SIZE) == 0 && ok;
+    free(mem->views);
+    free(mem->view_list);
+    if (mem->ram_fd >= 0)
+        close(mem->ram_fd);
+    if (mem->fd >= 0)
+        close(mem->fd);
+
+    mem->ram_banks = NULL;
+    mem->views = NULL;
+    mem->view_list = NULL;
+    mem->view_count = 0;
+    mem->ram_fd = -1;
+    mem->fd = -1;
+    return ok;
+}
+
 /* initialize memory layout and map file filename */
 bool gb_memory_init(gb_memory *mem, const char *filename)
 {
+    mem->ram_fd = -1;
+    mem->ram_banks = NULL;
+    mem->rom_bank_count = 2;
+    mem->views = NULL;
+    mem->view_list = NULL;
+    mem->view_count = 0;
+#ifdef FASTMEM
+    mem->ro_pages = 0;
+#endif
+
     if (!filename) {
         mem->fd = -1;
         mem->mem = mmap((void *) 0x1000000, 0x10008, PROT_READ | PROT_WRITE,
@@ -218,6 +521,7 @@ bool gb_memory_init(gb_memory *mem, const char *filename)
             LOG_ERROR("Map failed! (%i)\n", errno);
             return false;
         }
+        mem->ram_banks = NULL;
     } else {
         mem->fd = open(filename, O_RDONLY);
         if (mem->fd < 0) {
@@ -225,22 +529,37 @@ bool gb_memory_init(gb_memory *mem, const char *filename)
             return false;
         }
 
-        mem->mem = mmap((void *) 0x1000000, 0x8000, PROT_READ, MAP_PRIVATE,
-                        mem->fd, 0);
-        if (mem->mem == MAP_FAILED) {
-            LOG_ERROR("Map failed! (%i)\n", errno);
-            return false;
+        struct stat st;
+        if (fstat(mem->fd, &st) != 0) {
+            LOG_ERROR("Could not stat file! (%i)\n", errno);
+            goto fail;
         }
+        mem->rom_bank_count = st.st_size > 0x8000 ? st.st_size / 0x4000 : 2;
+        if (mem->rom_bank_count > 0x100)
+            mem->rom_bank_count = 0x100;
+        unsigned views = mem->rom_bank_count * (MAX_RAM_BANKS + 1);
 
-        if (mmap(mem->mem + 0x8000, 0x8000, PROT_READ | PROT_WRITE,
-                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
-                 0) == MAP_FAILED) {
+        mem->ram_fd = memfd_create("jitboy-ram", 0);
+        if (mem->ram_fd < 0 || ftruncate(mem->ram_fd, RAM_SIZE) != 0) {
             LOG_ERROR("Allocating memory failed! (%i)\n", errno);
-            return false;
+            goto fail;
         }
-    }
 
-    mem->ram_banks = malloc(MAX_RAM_BANKS * 0x2000);
+        /* the cartridge RAM banks, as save.c sees them */
+        mem->ram_banks = mmap(NULL, MAX_RAM_BANKS * 0x2000,
+                              PROT_READ | PROT_WRITE, MAP_SHARED, mem->ram_fd,
+                              RAM_BANKS);
+        mem->views = calloc(views, sizeof(uint8_t *));
+        mem->view_list = malloc(views * sizeof(uint8_t *));
+        if (mem->ram_banks == MAP_FAILED || !mem->views || !mem->view_list) {
+            LOG_ERROR("Allocating memory failed! (%i)\n", errno);
+            goto fail;
+        }
+
+        mem->mem = map_view(mem, 1, 0);
+        if (!mem->mem)
+            goto fail;
+    }
 
     mem->filename = filename;
 
@@ -261,18 +580,26 @@ bool gb_memory_init(gb_memory *mem, const char *filename)
     mem->rtc_access = false;
 
     return true;
+
+fail:
+    gb_memory_release(mem);
+    return false;
 }
 
 /* free memory again */
 bool gb_memory_free(gb_memory *mem)
 {
-    free(mem->ram_banks);
     free(mem->savname);
 
-    close(mem->fd);
+    if (mem->fd < 0) {
+        if (munmap(mem->mem, 0x10008) != 0) {
+            LOG_ERROR("munmap failed (%i)\n", errno);
+            return false;
+        }
+        return true;
+    }
 
-    if (munmap(mem->mem, 0x8000) != 0 ||
-        munmap(mem->mem + 0x8000, 0x8000) != 0) {
+    if (!gb_memory_release(mem)) {
         LOG_ERROR("munmap failed (%i)\n", errno);
         return false;
     }
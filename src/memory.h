@@ -4,8 +4,13 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef FASTMEM
+/* offset of the store-only mirror in each view, see map_view() */
+#define FASTMEM_MIRROR 0x10000
+#endif
+
 typedef struct {
-    uint8_t *mem;
+    uint8_t *mem; /* view of the address space with the current banks */
     uint8_t *ram_banks;
     const char *filename;
     char *savname;
@@ -26,6 +31,19 @@ typedef struct {
     uint8_t mbc_mode, mbc_data;
     uint8_t current_rom_bank, current_ram_bank;
     bool rtc_access;
+
+    /* Every combination of ROM bank and RAM bank in use has a view of its
+     * own, so switching banks only switches views. The RAM of all views is
+     * the same memfd.
+     */
+    int ram_fd;
+    unsigned rom_bank_count;
+    uint8_t **views; /* by ROM bank and RAM bank, NULL until used */
+    uint8_t **view_list;
+    unsigned view_count;
+#ifdef FASTMEM
+    uint16_t ro_pages; /* mirror pages that are read-only in all views */
+#endif
 } gb_memory;
 
 typedef struct {
@@ -41,6 +59,16 @@ typedef struct {
     } state;
 } gb_keys;
 
+struct gb_link;
+
+/* entries of the shadow return stack, a power of two */
+#define GB_RAS_SIZE 32
+#define GB_RAS_NONE UINT64_MAX
+
+/* entries of the jump cache, a power of two */
+#define GB_JC_SIZE 256
+#define GB_JC_NONE UINT64_MAX
+
 typedef struct {
     // memory
     gb_memory *mem;
@@ -51,6 +79,7 @@ typedef struct {
     uint16_t _sp;
     uint16_t pc;
     uint64_t flags;
+    uint16_t hl; /* scratch of translated code for splitting up HL */
 
     uint16_t last_pc;
 
@@ -66,6 +95,9 @@ typedef struct {
 
     uint64_t next_update;
 
+    // block exit taken by the last return to the dispatcher
+    struct gb_link *last_exit;
+
     // interrupt timers etc
     bool ime;
 
@@ -81,14 +113,80 @@ typedef struct {
         REASON_INT = 4,
         REASON_RET = 8
     } trap_reason;
+
+    // shadow return stack of the calls made by translated code, a ring
+    struct {
+        uint64_t addr; /* guest return address, GB_RAS_NONE if unused */
+        void *code;    /* exit of the calling block towards addr */
+    } ras[GB_RAS_SIZE];
+    uint8_t ras_top;
+
+    // translated ROM blocks by gb_jump_key(), for indirect jumps
+    struct {
+        uint64_t key; /* GB_JC_NONE if unused */
+        void *code;
+    } jump_cache[GB_JC_SIZE];
+
+    // non-zero for each byte of RAM (0x8000 - 0xffff) holding translated code
+    uint8_t code_map[0x8000];
 } gb_state;
 
-/* flush back external RAM(0xa000 - 0xbfff) to ram_banks buffer */
-void gb_memory_ram_flush(gb_memory *mem);
+/* Calls and returns outside translated code keep the shadow return stack
+ * balanced, with entries that never match.
+ */
+static inline void gb_ras_push(gb_state *state)
+{
+    state->ras_top = (state->ras_top + 1) & (GB_RAS_SIZE - 1);
+    state->ras[state->ras_top].addr = GB_RAS_NONE;
+}
+
+static inline void gb_ras_pop(gb_state *state)
+{
+    state->ras_top = (state->ras_top - 1) & (GB_RAS_SIZE - 1);
+}
+
+/* tells blocks at addr apart by the ROM bank mapped at 0x4000 if needed */
+static inline uint32_t gb_jump_key(uint16_t addr, uint8_t bank)
+{
+    return addr < 0x4000 ? addr : (uint32_t) bank << 16 | addr;
+}
 
 /* emulate write through mbc */
 void gb_memory_write(gb_state *state, uint64_t addr, uint64_t value);
 
+/* Copy up to n bytes from src upwards to dst upwards, as far as plain stores
+ * reach and the result matches copying byte by byte. Returns the bytes
+ * copied.
+ */
+uint64_t gb_memory_copy(gb_state *state,
+                        uint64_t dst,
+                        uint64_t src,
+                        uint64_t n);
+
+/* Store value to up to n bytes from dst on, upwards if step is 1 and
+ * downwards if it is -1, as far as plain stores reach. Returns the bytes
+ * stored.
+ */
+uint64_t gb_memory_fill(gb_state *state,
+                        uint64_t dst,
+                        uint64_t value,
+                        uint64_t n,
+                        int64_t step);
+
+typedef void (*gb_write_handler)(gb_state *state,
+                                 uint64_t addr,
+                                 uint64_t value);
+
+/* handler for writes to the constant address addr, NULL if the value can be
+ * stored directly into memory
+ */
+gb_write_handler gb_memory_write_handler(uint16_t addr);
+
+#ifdef FASTMEM
+/* change the protection of the mirror page holding addr in every view */
+void gb_memory_protect_page(gb_memory *mem, uint16_t addr, int prot);
+#endif
+
 /* initialize memory layout and map file filename */
 bool gb_memory_init(gb_memory *mem, const char *filename);
 
@@ -1,3 +1,5 @@
+#include <inttypes.h>
+
 #include "emit.h"
 
 /* The instruction always has the same result deterministically regardless of
@@ -99,151 +101,943 @@ static bool is_jump_to_start(gbz80_inst *inst, int byte_offset)
     return false;
 }
 
-bool optimize_block(GList **instructions, int opt_level)
+/* guest flags the instruction reads, including everything at block exits */
+static uint8_t flags_used(gbz80_inst *inst)
 {
-    if (opt_level == 0) /* no optimization */
+    switch (inst->opcode) {
+    case ADC:
+    case SBC:
+    case RLA:
+    case RRA:
+    case RL:
+    case RR:
+    case CCF:
+        return GUEST_C;
+    case DAA:
+        return GUEST_N | GUEST_H | GUEST_C;
+    case PUSH:
+        return inst->op1 == REG_AF ? GUEST_FLAGS : 0;
+    case JP:
+    case JR:
+    case CALL:
+    case RST:
+    case RET:
+    case RETI:
+    case JP_FWD:
+    case JP_BWD:
+    case JP_TARGET: /* entered from elsewhere */
+    case HALT:
+    case STOP:
+    case EI:
+#ifdef INSTRUCTION_TEST
+    case LD_F:
+#endif
+        return GUEST_FLAGS;
+    default:
+        return 0;
+    }
+}
+
+/* guest flags the instruction overwrites */
+static uint8_t flags_defined(gbz80_inst *inst)
+{
+    switch (inst->opcode) {
+    case ADD:
+    case ADC:
+    case SUB:
+    case SBC:
+    case AND:
+    case OR:
+    case XOR:
+    case CP:
+    case RLCA:
+    case RRCA:
+    case RLA:
+    case RRA:
+    case RLC:
+    case RRC:
+    case RL:
+    case RR:
+    case SLA:
+    case SRA:
+    case SRL:
+    case SWAP:
+#ifdef INSTRUCTION_TEST
+    case SET_F:
+#endif
+        return GUEST_FLAGS;
+    case INC:
+    case DEC:
+    case BIT:
+        return GUEST_Z | GUEST_N | GUEST_H;
+    case DAA:
+        return GUEST_Z | GUEST_H | GUEST_C;
+    case CPL:
+        return GUEST_N | GUEST_H;
+    case SCF:
+    case CCF:
+        return GUEST_N | GUEST_H | GUEST_C;
+    case ADD16:
+        return inst->op1 == REG_SP ? GUEST_FLAGS
+                                   : GUEST_N | GUEST_H | GUEST_C;
+    case LD16:
+        return inst->op2 == MEM_8 ? GUEST_FLAGS : 0;
+    case POP:
+        return inst->op1 == REG_AF ? GUEST_FLAGS : 0;
+    default:
+        return 0;
+    }
+}
+
+/* Backward liveness of the guest flags. Everything is live when the block
+ * is left, so only results overwritten within the block are found dead.
+ */
+static bool pass_flags(gb_inst_array *instructions,
+                       int opt_level,
+                       unsigned *changed)
+{
+    uint8_t live = GUEST_FLAGS;
+    for (unsigned i = instructions->count; i-- > 0;) {
+        gbz80_inst *inst = &instructions->inst[i];
+        inst->dead_flags = GUEST_FLAGS & ~live;
+        if (inst->dead_flags)
+            (*changed)++;
+        live = (live & ~flags_defined(inst)) | flags_used(inst);
+    }
+    return true;
+}
+
+/* guest registers an operand refers to */
+static uint8_t operand_regs(int op)
+{
+    switch (op) {
+    case REG_A:
+    case REG_AF:
+        return GUEST_REG_A;
+    case REG_B:
+        return GUEST_REG_B;
+    case REG_C:
+    case MEM_C:
+        return GUEST_REG_C;
+    case REG_D:
+        return GUEST_REG_D;
+    case REG_E:
+        return GUEST_REG_E;
+    case REG_H:
+        return GUEST_REG_H;
+    case REG_L:
+        return GUEST_REG_L;
+    case REG_BC:
+    case MEM_BC:
+        return GUEST_REG_B | GUEST_REG_C;
+    case REG_DE:
+    case MEM_DE:
+    case MEM_INC_DE:
+        return GUEST_REG_D | GUEST_REG_E;
+    case REG_HL:
+    case MEM_HL:
+    case MEM_INC_HL:
+    case MEM_DEC_HL:
+        return GUEST_REG_H | GUEST_REG_L;
+    case REG_SP:
+        return GUEST_REG_SP;
+    default:
+        return 0;
+    }
+}
+
+static bool is_reg8(int op)
+{
+    return op >= REG_A && op <= REG_L;
+}
+
+/* guest registers the instruction reads, everything at block exits */
+static uint8_t regs_used(gbz80_inst *inst)
+{
+    uint8_t regs = operand_regs(inst->op2);
+    switch (inst->opcode) {
+    case LD:
+        /* a register destination is only written */
+        return is_reg8(inst->op1) ? regs : regs | operand_regs(inst->op1);
+    case LD16:
+        /* LD HL,SP+e */
+        return inst->op2 == MEM_8 ? GUEST_REG_SP : regs;
+    case POP:
+        return GUEST_REG_SP;
+    case PUSH:
+        return operand_regs(inst->op1) | GUEST_REG_SP;
+    case DAA:
+        return GUEST_REG_A;
+    case NOP:
+    case DI:
+    case ADD16:
+    case INC16:
+    case DEC16:
+    case INC:
+    case DEC:
+    case ADD:
+    case ADC:
+    case SUB:
+    case SBC:
+    case AND:
+    case XOR:
+    case OR:
+    case CP:
+    case CPL:
+    case SCF:
+    case CCF:
+    case RLCA:
+    case RRCA:
+    case RLA:
+    case RRA:
+    case RLC:
+    case RRC:
+    case RL:
+    case RR:
+    case SLA:
+    case SRA:
+    case SRL:
+    case SWAP:
+    case BIT:
+    case RES:
+    case SET:
+        return regs | operand_regs(inst->op1);
+    default: /* jumps, HALT, EI and whatever else may leave the block */
+        return GUEST_REGS;
+    }
+}
+
+/* guest registers the instruction overwrites completely */
+static uint8_t regs_defined(gbz80_inst *inst)
+{
+    switch (inst->opcode) {
+    case LD:
+        return is_reg8(inst->op1) ? operand_regs(inst->op1) : 0;
+    case LD16:
+    case POP:
+        return operand_regs(inst->op1);
+    default:
+        return 0;
+    }
+}
+
+/* Backward liveness of the guest registers, like pass_flags(). Helper calls
+ * only save the host registers of those still needed.
+ */
+static bool pass_regs(gb_inst_array *instructions,
+                      int opt_level,
+                      unsigned *changed)
+{
+    uint8_t live = GUEST_REGS;
+    for (unsigned i = instructions->count; i-- > 0;) {
+        gbz80_inst *inst = &instructions->inst[i];
+        uint8_t used = regs_used(inst);
+        inst->dead_regs = GUEST_REGS & ~(live | used);
+        if (inst->dead_regs)
+            (*changed)++;
+        live = (live & ~regs_defined(inst)) | used;
+    }
+    return true;
+}
+
+/* The instruction has no effect left but its cycles. */
+static void make_nop(gbz80_inst *inst)
+{
+    inst->opcode = NOP;
+    inst->op1 = NONE;
+    inst->op2 = NONE;
+    inst->flags = INST_FLAG_NONE;
+}
+
+static bool is_mem(int op)
+{
+    switch (op) {
+    case MEM_BC:
+    case MEM_DE:
+    case MEM_HL:
+    case MEM_16:
+    case MEM_8:
+    case MEM_C:
+    case MEM_INC_DE:
+    case MEM_INC_HL:
+    case MEM_DEC_HL:
         return true;
+    default:
+        return false;
+    }
+}
+
+/* LD r,x that only sets r, x is read without side effects */
+static bool is_plain_load(gbz80_inst *inst)
+{
+    if (inst->opcode != LD || !is_reg8(inst->op1))
+        return false;
+    return is_reg8(inst->op2) || inst->op2 == IMM8 || inst->op2 == MEM_BC ||
+           inst->op2 == MEM_DE || inst->op2 == MEM_HL ||
+           inst->op2 == MEM_16 || inst->op2 == MEM_8 || inst->op2 == MEM_C;
+}
+
+/* What an 8-bit guest register is known to hold at some point of the block.
+ * Reads of guest memory have no side effects in translated code, and nothing
+ * but the block itself writes memory while it runs.
+ */
+typedef struct {
+    enum {
+        VAL_UNKNOWN,
+        VAL_IMM, /* the constant n */
+        VAL_MEM, /* the byte at address n, until the next store */
+        VAL_REG  /* a copy of the register REG_A + n, until that changes */
+    } kind;
+    uint16_t n;
+} gb_value;
+
+#define VALUE_REGS 7 /* A - L, SP is not tracked */
+
+/* value the source operand of a plain load yields */
+static gb_value load_value(const gb_value *values, gbz80_inst *inst)
+{
+    switch (inst->op2) {
+    case IMM8:
+        return (gb_value){VAL_IMM, inst->args[1]};
+    case MEM_16:
+        return (gb_value){VAL_MEM, inst->args[1] | inst->args[2] << 8};
+    case MEM_8:
+        return (gb_value){VAL_MEM, 0xff00 + inst->args[1]};
+    default:
+        if (!is_reg8(inst->op2))
+            return (gb_value){VAL_UNKNOWN, 0};
+        if (values[inst->op2 - REG_A].kind != VAL_UNKNOWN)
+            return values[inst->op2 - REG_A];
+        return (gb_value){VAL_REG, inst->op2 - REG_A};
+    }
+}
+
+static bool same_value(gb_value a, gb_value b)
+{
+    return a.kind != VAL_UNKNOWN && a.kind == b.kind && a.n == b.n;
+}
+
+/* forget what depends on register r */
+static void value_clobber(gb_value *values, unsigned r)
+{
+    values[r].kind = VAL_UNKNOWN;
+    for (unsigned i = 0; i < VALUE_REGS; ++i) {
+        if (values[i].kind == VAL_REG && values[i].n == r)
+            values[i].kind = VAL_UNKNOWN;
+    }
+}
+
+/* track the effect of inst on values */
+static void value_update(gb_value *values, gbz80_inst *inst)
+{
+    /* merge points and exits, everything else mentions what it changes */
+    if (regs_used(inst) == GUEST_REGS) {
+        memset(values, 0, VALUE_REGS * sizeof(gb_value));
+        return;
+    }
 
-    for (GList *inst = *instructions; inst != NULL; inst = inst->next) {
-        uint32_t *a = (uint32_t *) DATA(inst)->args;
+    if (is_mem(inst->op1) || inst->opcode == PUSH) {
+        for (unsigned i = 0; i < VALUE_REGS; ++i) {
+            if (values[i].kind == VAL_MEM)
+                values[i].kind = VAL_UNKNOWN;
+        }
+    }
+
+    if (is_plain_load(inst)) {
+        unsigned r = inst->op1 - REG_A;
+        gb_value v = load_value(values, inst);
+        value_clobber(values, r);
+        if (!(v.kind == VAL_REG && v.n == r))
+            values[r] = v;
+        return;
+    }
+
+    uint8_t changed = operand_regs(inst->op1) | regs_defined(inst);
+    if (inst->opcode == DAA || inst->op1 == MEM_INC_DE)
+        changed |= GUEST_REG_A;
+    if (inst->op1 == MEM_INC_DE || inst->op1 == MEM_INC_HL ||
+        inst->op1 == MEM_DEC_HL || inst->op2 == MEM_INC_HL ||
+        inst->op2 == MEM_DEC_HL)
+        changed |= operand_regs(inst->op1) | operand_regs(inst->op2);
+    for (unsigned r = 0; r < VALUE_REGS; ++r) {
+        if (changed & 1 << r)
+            value_clobber(values, r);
+    }
+}
+
+/* LD r,n with r holding n already */
+static bool pass_constants(gb_inst_array *instructions,
+                           int opt_level,
+                           unsigned *changed)
+{
+    gb_value values[VALUE_REGS] = {0};
+    for (unsigned i = 0; i < instructions->count; ++i) {
+        gbz80_inst *inst = &instructions->inst[i];
+        if (is_plain_load(inst)) {
+            gb_value v = load_value(values, inst);
+            if (v.kind == VAL_IMM && same_value(values[inst->op1 - REG_A], v)) {
+                make_nop(inst);
+                (*changed)++;
+            }
+        }
+        value_update(values, inst);
+    }
+    return true;
+}
+
+/* LD r,x with x a copy of y reads y instead, so the copy may become dead.
+ * Copies between registers holding the same value already go away.
+ */
+static bool pass_copies(gb_inst_array *instructions,
+                        int opt_level,
+                        unsigned *changed)
+{
+    gb_value values[VALUE_REGS] = {0};
+    for (unsigned i = 0; i < instructions->count; ++i) {
+        gbz80_inst *inst = &instructions->inst[i];
+        if (is_plain_load(inst) && is_reg8(inst->op2)) {
+            unsigned r = inst->op1 - REG_A, x = inst->op2 - REG_A;
+            gb_value v = load_value(values, inst);
+            if (r == x || same_value(values[r], v) ||
+                (values[r].kind == VAL_REG && values[r].n == x) ||
+                (v.kind == VAL_REG && v.n == r)) {
+                make_nop(inst);
+                (*changed)++;
+            } else if (values[x].kind == VAL_REG) {
+                inst->op2 = REG_A + values[x].n;
+                (*changed)++;
+            }
+        }
+        value_update(values, inst);
+    }
+    return true;
+}
+
+/* Loads from a constant address the block read before, with no store in
+ * between: dropped if the register holds the byte already, a register copy
+ * if another one does.
+ */
+static bool pass_loads(gb_inst_array *instructions,
+                       int opt_level,
+                       unsigned *changed)
+{
+    gb_value values[VALUE_REGS] = {0};
+    for (unsigned i = 0; i < instructions->count; ++i) {
+        gbz80_inst *inst = &instructions->inst[i];
+        if (is_plain_load(inst) &&
+            (inst->op2 == MEM_16 || inst->op2 == MEM_8)) {
+            gb_value v = load_value(values, inst);
+            unsigned r = inst->op1 - REG_A;
+            if (same_value(values[r], v)) {
+                make_nop(inst);
+                (*changed)++;
+            } else {
+                for (unsigned x = 0; x < VALUE_REGS; ++x) {
+                    if (same_value(values[x], v)) {
+                        inst->op2 = REG_A + x;
+                        (*changed)++;
+                        break;
+                    }
+                }
+            }
+        }
+        value_update(values, inst);
+    }
+    return true;
+}
+
+/* Plain loads into guest registers overwritten before anything reads them */
+static bool pass_dead_stores(gb_inst_array *instructions,
+                             int opt_level,
+                             unsigned *changed)
+{
+    uint8_t live = GUEST_REGS;
+    for (unsigned i = instructions->count; i-- > 0;) {
+        gbz80_inst *inst = &instructions->inst[i];
+        uint8_t defined = regs_defined(inst);
+        bool plain = is_plain_load(inst) ||
+                     (inst->opcode == LD16 && inst->op2 == IMM16 &&
+                      inst->op1 != MEM_16);
+        if (plain && !(live & defined)) {
+            make_nop(inst);
+            (*changed)++;
+        }
+        live = (live & ~regs_defined(inst)) | regs_used(inst);
+    }
+    return true;
+}
+
+/* Byte patterns of known idioms, replaced by cheaper instructions */
+static bool pass_patterns(gb_inst_array *instructions,
+                          int opt_level,
+                          unsigned *changed)
+{
+    gbz80_inst *insts = instructions->inst;
+    for (unsigned i = 0; i < instructions->count; ++i) {
+        gbz80_inst *inst = &insts[i];
+        uint32_t *a = (uint32_t *) inst->args;
 
         /* pattern is LD A,HL+; LD (DE),A; INC DE -> LD DE+, HL+ */
         if ((*a & 0xffffff) == 0x13122a) {
-            LOG_DEBUG("optimizing block @%#x (3)\n",
-                      DATA(*instructions)->address);
-            DATA(inst)->op1 = MEM_INC_DE;
-            DATA(inst)->cycles = 6;
-            DATA(inst)->bytes = 3;
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
+            LOG_DEBUG("optimizing block @%#x (3)\n", insts[0].address);
+            inst->op1 = MEM_INC_DE;
+            inst->cycles = 6;
+            inst->bytes = 3;
+            inst_array_remove(instructions, i + 1, 2);
+            (*changed)++;
         }
 
         /* pattern f0 41 e6 03 20 fa -> wait for stat mode 3 */
         if ((*a) == 0x03e641f0 && (*(a + 1) & 0xffff) == 0xfa20) {
-            LOG_DEBUG("optimizing block @%#x (4)\n",
-                      DATA(*instructions)->address);
-            DATA(inst)->opcode = HALT;
-            DATA(inst)->op1 = WAIT_STAT3;
-            DATA(inst)->cycles = 0;
-            DATA(inst)->bytes = 6;
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
+            LOG_DEBUG("optimizing block @%#x (4)\n", insts[0].address);
+            inst->opcode = HALT;
+            inst->op1 = WAIT_STAT3;
+            inst->cycles = 0;
+            inst->bytes = 6;
+            inst_array_remove(instructions, i + 1, 2);
+            (*changed)++;
         }
 
         /* pattern f0 44 fe ?? 20 fa -> wait for ly */
         if ((*a & 0x00ffffff) == 0xfe44f0 && (*(a + 1) & 0xffff) == 0xfa20) {
-            LOG_DEBUG("optimizing block @%#x (5)\n",
-                      DATA(*instructions)->address);
-            DATA(inst)->opcode = HALT;
-            DATA(inst)->op1 = WAIT_LY;
-            DATA(inst)->cycles = 0;
-            DATA(inst)->bytes = 6;
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
+            LOG_DEBUG("optimizing block @%#x (5)\n", insts[0].address);
+            inst->opcode = HALT;
+            inst->op1 = WAIT_LY;
+            inst->cycles = 0;
+            inst->bytes = 6;
+            inst_array_remove(instructions, i + 1, 2);
+            (*changed)++;
         }
 
         /* pattern f0 00 f0 00 -> repeated read of jopad register */
         if ((*a) == 0x00f000f0) {
-            LOG_DEBUG("optimizing block @%#x (6)\n",
-                      DATA(*instructions)->address);
-            DATA(inst)->cycles += 3;
-            DATA(inst)->bytes += 2;
-            DATA(inst)->args = DATA(inst->next)->args;
-            g_free(inst->next->data);
-            *instructions = g_list_delete_link(*instructions, inst->next);
-            if (inst->prev) /* apply pattern to this instruction again */
-                inst = inst->prev;
+            LOG_DEBUG("optimizing block @%#x (6)\n", insts[0].address);
+            inst->cycles += 3;
+            inst->bytes += 2;
+            inst->args = insts[i + 1].args;
+            inst_array_remove(instructions, i + 1, 1);
+            (*changed)++;
+            if (i > 0) /* apply pattern to this instruction again */
+                i--;
         }
     }
+    return true;
+}
 
+/* Loops jumping back to the start of the block stay inside translated code */
+static bool pass_loops(gb_inst_array *instructions,
+                       int opt_level,
+                       unsigned *changed)
+{
     int byte_offset = 0;
-    for (GList *inst = *instructions; inst != NULL; inst = inst->next) {
-        byte_offset += DATA(inst)->bytes;
-        if (is_jump_to_start(DATA(inst), byte_offset)) {
+    for (unsigned i = 0; i < instructions->count; ++i) {
+        byte_offset += instructions->inst[i].bytes;
+        if (is_jump_to_start(&instructions->inst[i], byte_offset)) {
             bool can_optimize1 = true;
             bool can_optimize2 = true;
-            for (GList *inst2 = *instructions; inst2 != inst;
-                 inst2 = inst2->next) {
-                if (!is_const(DATA(inst2), opt_level))
+            for (unsigned j = 0; j < i; ++j) {
+                if (!is_const(&instructions->inst[j], opt_level))
                     can_optimize1 = false;
 
-                if (!is_no_mem_access(DATA(inst2), opt_level))
+                if (!is_no_mem_access(&instructions->inst[j], opt_level))
                     can_optimize2 = false;
             }
 
+            uint16_t address = instructions->inst[0].address;
+            /* backward jumps leave once the cycle budget is used up, so
+             * interrupts still get through. ROM code cannot change under
+             * the loop either.
+             */
+            if (opt_level >= 2 && address < 0x8000)
+                can_optimize2 = true;
+
             if (can_optimize1) {
-                LOG_DEBUG("optimizing block @%#x (1)\n",
-                          DATA(*instructions)->address);
+                LOG_DEBUG("optimizing block @%#x (1)\n", address);
                 /* optimize  2: ... JP <2
                  * to        JP >1 2: HALT 1: ... JP <2
                  *
                  * insert jump target at the position of the old start
-                 * instruction.
-                 */
-                gbz80_inst *jp_target = g_new(gbz80_inst, 1);
-                *jp_target = (gbz80_inst){
-                    JP_TARGET, TARGET_1, NONE, 0, DATA(*instructions)->address,
-                    0,         0,        0,    0};
-                *instructions = g_list_prepend(*instructions, jp_target);
-                /* prepend halt, as the loop cannot change the break condition
+                 * instruction, prepend halt, as the loop cannot change the
+                 * break condition, a jump target before the halt instruction
+                 * and a jp to the old start instruction.
                  */
-                gbz80_inst *halt_inst = g_new(gbz80_inst, 1);
-                *halt_inst = (gbz80_inst){HALT,
-                                          NONE,
-                                          NONE,
-                                          0,
-                                          DATA(*instructions)->address,
-                                          1,
-                                          1,
-                                          1,
-                                          INST_FLAG_ENDS_BLOCK};
-                *instructions = g_list_prepend(*instructions, halt_inst);
-                /* prepend jump target before halt instruction */
-                gbz80_inst *jp_target2 = g_new(gbz80_inst, 1);
-                *jp_target2 = (gbz80_inst){
-                    JP_TARGET, TARGET_2, NONE, 0, DATA(*instructions)->address,
-                    0,         0,        0,    0};
-                *instructions = g_list_prepend(*instructions, jp_target2);
-                /* prepend jp, to jump to the old start instruction */
-                gbz80_inst *jp_inst = g_new(gbz80_inst, 1);
-                *jp_inst = (gbz80_inst){
-                    JP_FWD, NONE, TARGET_1, 0, DATA(*instructions)->address,
-                    0,      0,    0,        0};
-                *instructions = g_list_prepend(*instructions, jp_inst);
+                if (!inst_array_reserve(instructions, instructions->count + 4))
+                    return false;
+                gbz80_inst prologue[] = {
+                    {JP_FWD, NONE, TARGET_1, 0, address, 0, 0, 0, 0, 0, 0,
+                     0},
+                    {JP_TARGET, TARGET_2, NONE, 0, address, 0, 0, 0, 0, 0, 0,
+                     0},
+                    {HALT, NONE, NONE, 0, address, 1, 1, 1,
+                     INST_FLAG_ENDS_BLOCK, 0, 0, 0},
+                    {JP_TARGET, TARGET_1, NONE, 0, address, 0, 0, 0, 0, 0, 0,
+                     0},
+                };
+                for (unsigned j = 0; j < 4; ++j)
+                    inst_array_insert(instructions, j, prologue[j]);
+                i += 4;
+
                 /* modify jump to point to the halt instruction */
-                DATA(inst)->opcode = JP_BWD;
-                DATA(inst)->op2 = TARGET_2;
-                DATA(inst)->flags &= ~INST_FLAG_ENDS_BLOCK;
+                gbz80_inst *inst = &instructions->inst[i];
+                inst->opcode = JP_BWD;
+                inst->op2 = TARGET_2;
+                inst->flags &= ~INST_FLAG_ENDS_BLOCK;
+                (*changed)++;
                 break;
             } else if (can_optimize2) {
-                if (DATA(*instructions)->address < 0xff00) {
-                    LOG_DEBUG("optimizing block @%#x (2)\n",
-                              DATA(*instructions)->address);
+                if (address < 0xff00) {
+                    LOG_DEBUG("optimizing block @%#x (2)\n", address);
                 }
 
                 /* insert jump target at the position of the old start
                  * instruction.
                  */
-                gbz80_inst *jp_target = g_new(gbz80_inst, 1);
-                *jp_target = (gbz80_inst){
-                    JP_TARGET, TARGET_1, NONE, 0, DATA(*instructions)->address,
-                    0,         0,        0,    0};
-                *instructions = g_list_prepend(*instructions, jp_target);
-
-                DATA(inst)->opcode = JP_BWD;
-                DATA(inst)->op2 = TARGET_1;
+                gbz80_inst jp_target = {JP_TARGET, TARGET_1, NONE, 0, address,
+                                        0, 0, 0, 0, 0, 0, 0};
+                if (!inst_array_insert(instructions, 0, jp_target))
+                    return false;
+                i++;
+
+                gbz80_inst *inst = &instructions->inst[i];
+                inst->opcode = JP_BWD;
+                inst->op2 = TARGET_1;
+                (*changed)++;
             } else {
                 LOG_DEBUG("jp to start detected, could not optimize %#x\n",
-                          DATA(*instructions)->address);
+                          address);
             }
         }
     }
+    return true;
+}
+
+/* Length of the counter tail of a loop body ending at the jump at end:
+ * DEC r, or DEC16 rr / LD A,hi / OR lo (either half first). counter is set
+ * to r or rr. 0 if there is none.
+ */
+static unsigned loop_counter(gbz80_inst *insts, unsigned end, uint8_t *counter)
+{
+    gbz80_inst *dec = &insts[end - 1];
+    if (dec->opcode == DEC && dec->op1 >= REG_B && dec->op1 <= REG_E) {
+        *counter = dec->op1;
+        return 1;
+    }
+    if (end < 3)
+        return 0;
+
+    dec = &insts[end - 3];
+    gbz80_inst *ld = &insts[end - 2], *merge = &insts[end - 1];
+    if (dec->opcode != DEC16 || (dec->op1 != REG_BC && dec->op1 != REG_DE))
+        return 0;
+    unsigned hi = dec->op1 == REG_BC ? REG_B : REG_D;
+    if (ld->opcode != LD || ld->op1 != REG_A || merge->opcode != OR ||
+        merge->op1 != REG_A || (ld->op2 != hi && ld->op2 != hi + 1) ||
+        merge->op2 != (ld->op2 == hi ? hi + 1 : hi))
+        return 0;
+    *counter = dec->op1;
+    return 3;
+}
+
+/* the counter register r or rr lies in the register pair of op */
+static bool counter_overlaps(uint8_t counter, int op)
+{
+    switch (counter) {
+    case REG_BC:
+        return op == REG_B || op == REG_C;
+    case REG_DE:
+        return op == REG_D || op == REG_E;
+    default:
+        return op == counter;
+    }
+}
+
+/* Copy and fill loops walking HL and DE, counted down in B, C, D, E, BC or
+ * DE, as the loop pass leaves them: TARGET_1, body, JP_BWD NZ to TARGET_1.
+ * Copies are LD (DE+),(HL+) from the patterns, or LD A,(DE) / LD (HL+),A /
+ * INC DE. Fills are LD (HL+),r or LD (HL-),r, or LD (HL),r or n with an
+ * INC HL or DEC HL. A COPY or FILL in front runs all but the last iteration
+ * in one go, as far as plain stores reach, and the loop itself the rest.
+ * Interrupts wait for the bulk part, so this is left to level 3.
+ */
+static bool pass_bulk(gb_inst_array *instructions,
+                      int opt_level,
+                      unsigned *changed)
+{
+    gbz80_inst *insts = instructions->inst;
+    unsigned count = instructions->count;
+    if (count < 3 || insts[0].opcode != JP_TARGET || insts[0].op1 != TARGET_1)
+        return true;
+
+    unsigned end = 1;
+    while (end < count && insts[end].opcode != JP_BWD)
+        ++end;
+    if (end == count || insts[end].op1 != CC_NZ || insts[end].op2 != TARGET_1)
+        return true;
+
+    uint8_t counter;
+    unsigned tail = loop_counter(insts, end, &counter);
+    if (tail == 0)
+        return true;
+
+    gbz80_inst bulk = {COPY, NONE, NONE, 0, insts[0].address, 0, 0, 0, 0, 0,
+                       0, counter};
+    gbz80_inst *body = &insts[1];
+    unsigned length = end - tail - 1;
+    if (length == 1 && body[0].opcode == LD && body[0].op1 == MEM_INC_DE &&
+        body[0].op2 == MEM_INC_HL) {
+        bulk.op1 = MEM_INC_DE;
+        bulk.op2 = MEM_INC_HL;
+    } else if (length == 3 && body[0].opcode == LD && body[0].op1 == REG_A &&
+               body[0].op2 == MEM_DE &&
+               ((body[1].opcode == LD && body[1].op1 == MEM_INC_HL &&
+                 body[1].op2 == REG_A && body[2].opcode == INC16 &&
+                 body[2].op1 == REG_DE) ||
+                (body[1].opcode == INC16 && body[1].op1 == REG_DE &&
+                 body[2].opcode == LD && body[2].op1 == MEM_INC_HL &&
+                 body[2].op2 == REG_A))) {
+        bulk.op1 = MEM_INC_HL;
+        bulk.op2 = MEM_INC_DE;
+    } else if (length == 1 && body[0].opcode == LD &&
+               (body[0].op1 == MEM_INC_HL || body[0].op1 == MEM_DEC_HL) &&
+               body[0].op2 >= REG_A && body[0].op2 <= REG_E) {
+        bulk.opcode = FILL;
+        bulk.op1 = body[0].op1;
+        bulk.op2 = body[0].op2;
+    } else if (length == 2 && body[0].opcode == LD &&
+               body[0].op1 == MEM_HL &&
+               ((body[0].op2 >= REG_A && body[0].op2 <= REG_E) ||
+                body[0].op2 == IMM8) &&
+               (body[1].opcode == INC16 || body[1].opcode == DEC16) &&
+               body[1].op1 == REG_HL) {
+        bulk.opcode = FILL;
+        bulk.op1 = body[1].opcode == INC16 ? MEM_INC_HL : MEM_DEC_HL;
+        bulk.op2 = body[0].op2;
+        bulk.args = body[0].args;
+    } else {
+        return true;
+    }
+
+    /* the counter has to be left alone by the body, and A holds B | C or
+     * D | E after a 16-bit one
+     */
+    if (bulk.op1 == MEM_INC_DE || bulk.op2 == MEM_INC_DE) {
+        if (counter == REG_DE || counter == REG_D || counter == REG_E)
+            return true;
+    }
+    if (bulk.opcode == FILL && (counter_overlaps(counter, bulk.op2) ||
+                                (tail == 3 && bulk.op2 == REG_A)))
+        return true;
+
+    /* cycles of an iteration jumping back */
+    unsigned cycles = insts[end].cycles;
+    for (unsigned i = 1; i < end; ++i)
+        cycles += insts[i].cycles;
+    bulk.cycles = cycles;
 
+    LOG_DEBUG("optimizing block @%#x (7)\n", bulk.address);
+    if (!inst_array_insert(instructions, 0, bulk))
+        return false;
+    (*changed)++;
     return true;
 }
+
+/* conditional jump leaving through inst_jp() */
+static bool is_branch(gbz80_inst *inst)
+{
+    switch (inst->opcode) {
+    case JP:
+    case JR:
+    case JP_BWD:
+    case JP_FWD:
+    case CALL:
+        return inst->op1 == CC_Z || inst->op1 == CC_NZ || inst->op1 == CC_C ||
+               inst->op1 == CC_NC;
+    default:
+        return false;
+    }
+}
+
+/* Pairs of a flag producer and a conditional jump on its result, like
+ * CP n / JR NZ or DEC B / JR NZ. The loop counter idiom DEC BC / LD A,B /
+ * OR C / JR NZ ends in one as well. The flags only get to the stack copy
+ * where the jump is taken. BIT n,r only tests the bit if H and C are dead
+ * where the jump falls through.
+ */
+static bool pass_fusion(gb_inst_array *instructions,
+                        int opt_level,
+                        unsigned *changed)
+{
+    for (unsigned i = 1; i < instructions->count; ++i) {
+        gbz80_inst *producer = &instructions->inst[i - 1];
+        gbz80_inst *jump = &instructions->inst[i];
+        if (!is_branch(jump) || !(producer->flags & INST_FLAG_AFFECTS_CC) ||
+            (producer->flags & INST_FLAG_ENDS_BLOCK))
+            continue;
+        if (producer->opcode == BIT &&
+            ((jump->op1 != CC_Z && jump->op1 != CC_NZ) ||
+             (~jump->dead_flags & (GUEST_H | GUEST_C))))
+            continue;
+
+        producer->flags |= INST_FLAG_FUSED;
+        jump->flags |= INST_FLAG_FUSED;
+        (*changed)++;
+    }
+    return true;
+}
+
+/* Passes in the order they run. The value passes come before the liveness
+ * ones, so their annotations match the final instructions.
+ */
+static const struct {
+    const char *name;
+    int opt_level; /* lowest level running the pass */
+    bool (*run)(gb_inst_array *instructions, int opt_level, unsigned *changed);
+} passes[] = {
+    {"patterns", 1, pass_patterns},
+    {"loops", 1, pass_loops},
+    {"constants", 2, pass_constants},
+    {"copies", 2, pass_copies},
+    {"loads", 2, pass_loads},
+    {"dead-stores", 2, pass_dead_stores},
+    {"bulk", 3, pass_bulk},
+    {"flags", 1, pass_flags},
+    {"regs", 1, pass_regs},
+    {"fusion", 1, pass_fusion},
+};
+
+#define PASS_COUNT (sizeof(passes) / sizeof(passes[0]))
+
+/* instructions changed by each pass, for all threads */
+static uint64_t pass_changes[PASS_COUNT];
+
+static bool dump_ir;
+
+void optimize_dump(bool dump)
+{
+    dump_ir = dump;
+}
+
+static const char *const opcode_names[] = {
+    [NOP] = "NOP",     [LD16] = "LD16",     [LD] = "LD",
+    [INC16] = "INC16", [INC] = "INC",       [DEC16] = "DEC16",
+    [DEC] = "DEC",     [RLC] = "RLC",       [RLCA] = "RLCA",
+    [ADD16] = "ADD16", [ADD] = "ADD",       [RRC] = "RRC",
+    [RRCA] = "RRCA",   [STOP] = "STOP",     [RL] = "RL",
+    [RLA] = "RLA",     [JR] = "JR",         [RR] = "RR",
+    [RRA] = "RRA",     [DAA] = "DAA",       [CPL] = "CPL",
+    [SCF] = "SCF",     [CCF] = "CCF",       [HALT] = "HALT",
+    [ADC] = "ADC",     [SUB] = "SUB",       [SBC] = "SBC",
+    [AND] = "AND",     [XOR] = "XOR",       [OR] = "OR",
+    [CP] = "CP",       [RET] = "RET",       [POP] = "POP",
+    [JP] = "JP",       [CALL] = "CALL",     [PUSH] = "PUSH",
+    [RST] = "RST",     [RETI] = "RETI",     [DI] = "DI",
+    [EI] = "EI",       [SLA] = "SLA",       [SRA] = "SRA",
+    [SWAP] = "SWAP",   [SRL] = "SRL",       [BIT] = "BIT",
+    [RES] = "RES",     [SET] = "SET",       [JP_TARGET] = "TARGET",
+    [JP_BWD] = "JP_BWD", [JP_FWD] = "JP_FWD", [COPY] = "COPY",
+    [FILL] = "FILL",   [ERROR] = "ERROR",
+#ifdef INSTRUCTION_TEST
+    [SET_F] = "SET_F", [LD_F] = "LD_F",
+#endif
+};
+
+static const char *const operand_names[] = {
+    [REG_A] = "A",         [REG_B] = "B",          [REG_C] = "C",
+    [REG_D] = "D",         [REG_E] = "E",          [REG_H] = "H",
+    [REG_L] = "L",         [REG_AF] = "AF",        [REG_BC] = "BC",
+    [REG_DE] = "DE",       [REG_HL] = "HL",        [REG_SP] = "SP",
+    [MEM_BC] = "(BC)",     [MEM_DE] = "(DE)",      [MEM_HL] = "(HL)",
+    [MEM_C] = "(C)",       [MEM_INC_DE] = "(DE+)", [MEM_INC_HL] = "(HL+)",
+    [MEM_DEC_HL] = "(HL-)", [CC_Z] = "Z",          [CC_C] = "C",
+    [CC_NZ] = "NZ",        [CC_NC] = "NC",         [MEM_0x00] = "$00",
+    [MEM_0x08] = "$08",    [MEM_0x10] = "$10",     [MEM_0x18] = "$18",
+    [MEM_0x20] = "$20",    [MEM_0x28] = "$28",     [MEM_0x30] = "$30",
+    [MEM_0x38] = "$38",    [BIT_0] = "0",          [BIT_1] = "1",
+    [BIT_2] = "2",         [BIT_3] = "3",          [BIT_4] = "4",
+    [BIT_5] = "5",         [BIT_6] = "6",          [BIT_7] = "7",
+    [TARGET_1] = "<1>",    [TARGET_2] = "<2>",     [WAIT_LY] = "LY",
+    [WAIT_STAT3] = "STAT3",
+};
+
+static void dump_operand(FILE *f, gbz80_inst *inst, int op)
+{
+    switch (op) {
+    case IMM8:
+        fprintf(f, "$%02x", inst->args[1]);
+        break;
+    case IMM16:
+        fprintf(f, "$%04x", inst->args[1] | inst->args[2] << 8);
+        break;
+    case MEM_16:
+        fprintf(f, "($%04x)", inst->args[1] | inst->args[2] << 8);
+        break;
+    case MEM_8:
+        fprintf(f, "($ff%02x)", inst->args[1]);
+        break;
+    default:
+        fprintf(f, "%s", operand_names[op] ? operand_names[op] : "?");
+    }
+}
+
+static void dump_block(FILE *f, gb_inst_array *instructions)
+{
+    for (unsigned i = 0; i < instructions->count; ++i) {
+        gbz80_inst *inst = &instructions->inst[i];
+        fprintf(f, "  %04x  %-6s ", inst->address, opcode_names[inst->opcode]);
+        if (inst->op1 != NONE)
+            dump_operand(f, inst, inst->op1);
+        if (inst->op2 != NONE) {
+            fprintf(f, inst->op1 != NONE ? ", " : "");
+            dump_operand(f, inst, inst->op2);
+        }
+        fprintf(f, "\t; %u cycles, dead flags 0x%02x regs 0x%02x%s\n",
+                inst->cycles, inst->dead_flags, inst->dead_regs,
+                inst->flags & INST_FLAG_FUSED ? ", fused" : "");
+    }
+}
+
+bool optimize_block(gb_inst_array *instructions, int opt_level)
+{
+    if (opt_level == 0) /* no optimization */
+        return true;
+
+    /* a dump of the block is printed in one piece */
+    char *dump = NULL;
+    size_t dump_size = 0;
+    FILE *f = dump_ir ? open_memstream(&dump, &dump_size) : NULL;
+    if (f) {
+        fprintf(f, "block @%#x:\n", instructions->inst[0].address);
+        dump_block(f, instructions);
+    }
+
+    bool ok = true;
+    for (unsigned i = 0; ok && i < PASS_COUNT; ++i) {
+        if (opt_level < passes[i].opt_level)
+            continue;
+
+        unsigned changed = 0;
+        ok = passes[i].run(instructions, opt_level, &changed);
+        __atomic_fetch_add(&pass_changes[i], changed, __ATOMIC_RELAXED);
+        if (f && changed > 0) {
+            fprintf(f, "after %s, %u changed:\n", passes[i].name, changed);
+            dump_block(f, instructions);
+        }
+    }
+
+    if (f) {
+        fclose(f);
+        fputs(dump, stdout);
+        free(dump);
+    }
+    return ok;
+}
+
+void optimize_statistics(void)
+{
+    printf("- instructions changed by pass:");
+    for (unsigned i = 0; i < PASS_COUNT; ++i) {
+        printf(" %s %" PRIu64, passes[i].name,
+               __atomic_load_n(&pass_changes[i], __ATOMIC_RELAXED));
+    }
+    printf("\n");
+}
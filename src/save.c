@@ -44,8 +44,6 @@ bool write_battery(char *savfile, gb_memory *mem)
     if (!savfile)
         return false;
 
-    gb_memory_ram_flush(mem);
-
     FILE *fp = fopen(savfile, "wb");
     if (!fp) {
         LOG_ERROR("Failed to open file %s\n", savfile);
@@ -6,6 +6,7 @@
 #include "gbit/lib/tester.h"
 #include "instr_test.h"
 #include "src/core.h"
+#include "src/interp.h"
 
 
 static size_t instruction_mem_size;
@@ -28,7 +29,14 @@ static uint8_t flag;
  */
 static uint8_t *flag_args;
 /* the block for flag loading will be created at the initial and then cached */
-static gb_block *load_flag_block;
+static gb_block load_flag;
+static gb_block *load_flag_block = &load_flag;
+
+/* the block translated for each tested instruction */
+static gb_block step_block;
+
+/* run the tested instructions through interpret() instead of the JIT */
+static bool use_interpreter = false;
 
 static void gbz80_init(size_t tester_instruction_mem_size,
                        uint8_t *tester_instruction_mem)
@@ -42,7 +50,6 @@ static void gbz80_init(size_t tester_instruction_mem_size,
         exit(1);
     }
     flag_args = malloc(sizeof(uint8_t));
-    load_flag_block = &vm->compiled_blocks[2][0];
     build_load_flag_block(load_flag_block);
 }
 
@@ -78,6 +85,9 @@ static void gbz80_set_state(struct state *state)
     flag_args[0] |= (flag & 0x80) >> 1;
 
     vm->state.f_subtract = ((flag >> 6) & 1) == 1 ? true : false;
+    /* interpret() takes the flags in the same layout */
+    if (use_interpreter)
+        vm->state.flags = flag_args[0];
 
     vm->state.h = state->reg8.H;
     vm->state.l = state->reg8.L;
@@ -112,9 +122,33 @@ static void gbz80_get_state(struct state *state)
     num_mem_accesses = 0;
 }
 
+/* With INSTRUCTION_TEST, interpret() ends the block behind one instruction
+ * and leaves the exact program counter in the state.
+ */
+static int gbz80_interpret_step(void)
+{
+    uint64_t inst_count = vm->state.inst_count;
+    bool is_stop = vm->memory.mem[pc] == 0x10;
+
+    vm->state.pc = pc;
+    if (!interpret(&vm->state)) {
+        LOG_ERROR("Fail to interpret instruction\n");
+        exit(1);
+    }
+
+    /* the tester expects STOP to be skipped, as the JIT path reports it */
+    pc = is_stop && vm->state.pc == pc ? pc + 1 : vm->state.pc;
+    gbz80_restore_flag(vm->state.flags);
+
+    return vm->state.inst_count - inst_count;
+}
+
 static int gbz80_step(void)
 {
-    gb_block *block = &vm->compiled_blocks[1][0];
+    if (use_interpreter)
+        return gbz80_interpret_step();
+
+    gb_block *block = &step_block;
 
     struct instr_info inst_info =
         compile_and_run(block, &vm->memory, pc, flag_args);
@@ -123,7 +157,7 @@ static int gbz80_step(void)
     uint8_t opcode = inst_info.opcode;
     uint8_t bytes = inst_info.bytes;
 
-    uint16_t ret = block->func(&vm->state);
+    uint16_t ret = run_block(&vm->state, block);
 
     /* Due to the JIT compilation, not each instruction is executed at one time.
      * But this may violate the expectation of instructions tester. If we want
@@ -186,7 +220,7 @@ static int gbz80_step(void)
         pc = ret;
     }
 
-    load_flag_block->func(&vm->state);
+    run_block(&vm->state, load_flag_block);
     free_block(block);
 
     return inst_info.cycles;
@@ -241,6 +275,9 @@ static void print_usage(char *progname)
         "instructions.\n");
     printf(" -p, --print-inst       Print instruction undergoing tests.\n");
     printf(" -v, --print-input      Print every inputstate that is tested.\n");
+    printf(
+        " -i, --interpreter      Run the instructions through the interpreter "
+        "instead of the JIT.\n");
     printf(" -h, --help             Show this help.\n");
 }
 
@@ -252,10 +289,11 @@ static bool parse_args(int argc, char **argv)
             {"no-enable-cb", no_argument, 0, 'c'},
             {"print-inst", no_argument, 0, 'p'},
             {"print-input", no_argument, 0, 'v'},
+            {"interpreter", no_argument, 0, 'i'},
             {"help", no_argument, 0, 'h'},
             {0, 0, 0, 0}};
 
-        char c = getopt_long(argc, argv, "kcpvh", long_options, NULL);
+        char c = getopt_long(argc, argv, "kcpvih", long_options, NULL);
 
         if (c == -1)
             break;
@@ -273,6 +311,9 @@ static bool parse_args(int argc, char **argv)
         case 'v':
             flags.print_verbose_inputs = 1;
             break;
+        case 'i':
+            use_interpreter = true;
+            break;
         case 'h':
             print_usage(argv[0]);
             exit(0);
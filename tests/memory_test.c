@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/memory.h"
+
+/* Tests of gb_memory_copy() and gb_memory_fill(), which run COPY and FILL
+ * loops in bulk. With INSTRUCTION_TEST every store has to reach gbit, so
+ * these paths are only taken in a normal build and checked here.
+ *
+ * Each case runs the bulk call like the translated code does, finishes the
+ * loop byte by byte and compares all memory with the loop run byte by byte
+ * from the start.
+ */
+
+static gb_memory memory;
+static gb_state state;
+
+/* memory as the loop run byte by byte leaves it */
+static uint8_t expected[0x10000];
+
+static int failures;
+
+#define EXPECT_EQ(value, expect)                                           \
+    do {                                                                   \
+        unsigned long long v = (value), e = (expect);                      \
+        if (v != e) {                                                      \
+            printf("%s:%i: %s is %#llx, expected %#llx\n", __FILE__,       \
+                   __LINE__, #value, v, e);                                \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+/* distinct bytes everywhere, no translated code */
+static void reset(void)
+{
+    for (unsigned i = 0; i < 0x10000; ++i)
+        memory.mem[i] = i * 7 + (i >> 8);
+    memcpy(expected, memory.mem, 0x10000);
+    memset(state.code_map, 0, sizeof(state.code_map));
+}
+
+static void mark_code(uint16_t addr)
+{
+    state.code_map[addr - 0x8000] = 1;
+}
+
+static void copy_bytes(uint8_t *mem, uint16_t dst, uint16_t src, unsigned n)
+{
+    for (unsigned i = 0; i < n; ++i)
+        mem[(uint16_t) (dst + i)] = mem[(uint16_t) (src + i)];
+}
+
+static void fill_bytes(uint8_t *mem,
+                       uint16_t dst,
+                       uint8_t value,
+                       unsigned n,
+                       int step)
+{
+    for (unsigned i = 0; i < n; ++i)
+        mem[(uint16_t) (dst + (int) i * step)] = value;
+}
+
+static void check_memory(int line)
+{
+    for (unsigned i = 0; i < 0x10000; ++i) {
+        if (memory.mem[i] != expected[i]) {
+            printf("%s:%i: byte %#x is %#x, expected %#x\n", __FILE__, line,
+                   i, memory.mem[i], expected[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+#define CHECK_COPY(dst, src, n, done)                                      \
+    do {                                                                   \
+        uint64_t copied = gb_memory_copy(&state, dst, src, n);             \
+        EXPECT_EQ(copied, done);                                           \
+        copy_bytes(memory.mem, (dst) + copied, (src) + copied,             \
+                   (n) - copied);                                          \
+        copy_bytes(expected, dst, src, n);                                 \
+        check_memory(__LINE__);                                            \
+    } while (0)
+
+#define CHECK_FILL(dst, value, n, step, done)                              \
+    do {                                                                   \
+        uint64_t stored = gb_memory_fill(&state, dst, value, n, step);     \
+        EXPECT_EQ(stored, done);                                           \
+        fill_bytes(memory.mem, (dst) + (int) stored * (step), value,       \
+                   (n) - stored, step);                                    \
+        fill_bytes(expected, dst, value, n, step);                         \
+        check_memory(__LINE__);                                            \
+    } while (0)
+
+static void test_copy(void)
+{
+    reset();
+    CHECK_COPY(0xd000, 0xc000, 0x100, 0x100);
+
+    /* a destination above the source only gets the bytes not copied over */
+    reset();
+    CHECK_COPY(0xc101, 0xc100, 0x10, 1);
+    reset();
+    CHECK_COPY(0xc108, 0xc100, 0x20, 8);
+
+    /* below the source, reading ahead of the stores is what the loop does */
+    reset();
+    CHECK_COPY(0xc100, 0xc104, 0x20, 0x20);
+
+    /* I/O registers, ROM and translated code are stored to one by one */
+    reset();
+    CHECK_COPY(0xfef8, 0xc000, 0x20, 8);
+    reset();
+    CHECK_COPY(0x7ff0, 0xc000, 0x20, 0);
+    reset();
+    mark_code(0xc810);
+    CHECK_COPY(0xc800, 0xc000, 0x40, 0x10);
+    reset();
+    mark_code(0xc800);
+    CHECK_COPY(0xc800, 0xc000, 0x40, 0);
+}
+
+static void test_fill(void)
+{
+    reset();
+    CHECK_FILL(0xc000, 0x5a, 0x40, 1, 0x40);
+    reset();
+    CHECK_FILL(0xfef0, 0x5a, 0x20, 1, 0x10);
+    reset();
+    mark_code(0xc810);
+    CHECK_FILL(0xc800, 0x5a, 0x40, 1, 0x10);
+
+    /* downwards, as for ld (hl-), a */
+    reset();
+    CHECK_FILL(0xc83f, 0x5a, 0x20, -1, 0x20);
+    reset();
+    mark_code(0xc810);
+    CHECK_FILL(0xc830, 0x5a, 0x40, -1, 0x20);
+    reset();
+    CHECK_FILL(0x8010, 0x5a, 0x20, -1, 0x11);
+    reset();
+    CHECK_FILL(0xff10, 0x5a, 0x20, -1, 0);
+}
+
+/* A counter of 0 runs 256 or 65536 times, the bulk call gets all but the
+ * last iteration.
+ */
+static void test_counter_zero(void)
+{
+    reset();
+    CHECK_COPY(0xd000, 0xc000, 0xff, 0xff);
+    reset();
+    CHECK_COPY(0xc000, 0xd000, 0xffff, 0x3000);
+    reset();
+    CHECK_COPY(0xd000, 0xc000, 0xffff, 0x1000);
+    reset();
+    CHECK_COPY(0x9000, 0xf000, 0xffff, 0x1000);
+
+    reset();
+    CHECK_FILL(0xc000, 0xa5, 0xff, 1, 0xff);
+    reset();
+    CHECK_FILL(0xc000, 0xa5, 0xffff, 1, 0x3f00);
+    reset();
+    CHECK_FILL(0xdfff, 0xa5, 0xffff, -1, 0x6000);
+}
+
+int main(void)
+{
+    /* like gb_memory_init() without a ROM */
+    memory.mem = calloc(1, 0x10008);
+    if (!memory.mem) {
+        LOG_ERROR("Fail to initialize\n");
+        return 1;
+    }
+    memory.fd = -1;
+    state.mem = &memory;
+
+    test_copy();
+    test_fill();
+    test_counter_zero();
+
+    free(memory.mem);
+    if (failures > 0) {
+        printf("%i memory tests failed\n", failures);
+        return 1;
+    }
+    printf("All memory tests passed\n");
+    return 0;
+}